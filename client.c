@@ -14,6 +14,30 @@
 #include <linux/sched/signal.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/relay.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/bitops.h>
+#include <linux/seqlock.h>
+#include <linux/math64.h>
+#include <linux/kfifo.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/capability.h>
+
+#include "mailbox_capture.h"
+
+#define CREATE_TRACE_POINTS
+#include "mailbox_client_trace.h"
 
 #define MBOX_CHAN_0_TX          _IOW('m', 0, unsigned long)
 #define MBOX_CHAN_1_TX          _IOW('m', 1, unsigned long)
@@ -31,149 +55,2573 @@
 #define MBOX_CHAN_5_RX          _IOR('m', 5, unsigned long)
 #define MBOX_CHAN_6_RX          _IOR('m', 6, unsigned long)
 #define MBOX_CHAN_7_RX          _IOR('m', 7, unsigned long)
+/* any channel number, up to MBOX_CHAN_NUM per direction */
+#define MBOX_CHAN_TX(n)         _IOW('m', (n), unsigned long)
+#define MBOX_CHAN_RX(n)         _IOR('m', (n), unsigned long)
+
+#define MBOX_DMABUF_TX          _IOWR('m', 0x10, struct mbox_canaan_dmabuf)
+#define MBOX_TX_AGGR_CONFIG     _IOW('m', 0x11, struct mbox_canaan_aggr_config)
+#define MBOX_TX_AGGR_SEND       _IOW('m', 0x12, struct mbox_canaan_aggr_msg)
+#define MBOX_SNAPSHOT_CONFIG    _IOWR('m', 0x13, struct mbox_canaan_snapshot_config)
+#define MBOX_PERIODIC_START     _IOW('m', 0x14, struct mbox_canaan_periodic_config)
+#define MBOX_PERIODIC_QUEUE     _IOW('m', 0x15, struct mbox_canaan_periodic_msg)
+#define MBOX_PERIODIC_STOP      _IOW('m', 0x16, __u32)
+#define MBOX_PERIODIC_STATS     _IOWR('m', 0x17, struct mbox_canaan_periodic_stats)
+#define MBOX_HEAP_ALLOC         _IOWR('m', 0x18, struct mbox_canaan_heap_alloc)
+#define MBOX_HEAP_FREE          _IOW('m', 0x19, __u32)
+#define MBOX_TIMESYNC_CONVERT   _IOWR('m', 0x1a, struct mbox_canaan_timesync_convert)
+#define MBOX_POLL_MASK          _IOW('m', 0x1b, __u32)
+#define MBOX_HEAP_HANDOFF       _IOW('m', 0x1c, __u32)
+#define MBOX_DMABUF_WAIT        _IOW('m', 0x1d, struct mbox_canaan_dmabuf_wait)
+
+#define MBOX_CHAN_NUM           16
 
-#define MBOX_MAX_MSG_LEN        32
-#define SINGLE_DIR_CHAN_NUM     8
+#define TIMEOUT                 500 /* 50 millisecond */ 
+#define MBOX_NAME               "mailbox-client"  
+#define MBOX_CNT                1 
+
+#define MBOX_CAPTURE_SUBBUF_SIZE    (sizeof(struct mbox_canaan_capture_record) * 1024)
+#define MBOX_CAPTURE_SUBBUF_NUM     8
+
+/* MBOX_DMABUF_TX argument, handle is returned to userspace */
+struct mbox_canaan_dmabuf {
+    __u32   chan;
+    __s32   fd;
+    __u32   offset;
+    __u32   length;
+    __u32   handle;
+};
+
+#define MBOX_DMABUF_MAGIC       0x42444d42  /* "BMDB", cpu -> dsp descriptor */
+#define MBOX_DMABUF_DONE_MAGIC  0x44444d42  /* "BMDD", dsp -> cpu release */
+
+/*
+ * Sent over the channel instead of the data. The DSP answers on the
+ * control channel ("canaan,ctrl-chan") with { MBOX_DMABUF_DONE_MAGIC,
+ * handle } once it is done with the buffer, until then the attachment
+ * and mapping are kept alive.
+ */
+struct mbox_canaan_dmabuf_desc {
+    u32     magic;
+    u32     handle;
+    u64     addr;
+    u32     length;
+    u32     reserved[3];
+};
+
+/*
+ * MBOX_DMABUF_WAIT argument. Waits up to timeout_ms for the DSP to release
+ * handle, 0 only queries and returns -EBUSY while the buffer is held.
+ */
+struct mbox_canaan_dmabuf_wait {
+    __u32   handle;
+    __u32   timeout_ms;
+};
+
+/*
+ * default rx verdict of a channel, written through debugfs rx_verdict_N.
+ * Redirect queues the message on another rx channel, any other value
+ * drops it.
+ */
+#define MBOX_RX_PASS            0
+#define MBOX_RX_DROP            1
+#define MBOX_RX_REDIRECT        0x100
+#define MBOX_RX_REDIRECT_MASK   0xff
+/* redirected messages a channel holds until they are read */
+#define MBOX_RX_REDIRECT_DEPTH  16
+
+/* MBOX_TX_AGGR_CONFIG argument, max_bytes 0 means the whole window */
+struct mbox_canaan_aggr_config {
+    __u32   chan;
+    __u32   enable;
+    __u32   delay_us;
+    __u32   max_bytes;
+};
+
+/* MBOX_TX_AGGR_SEND argument */
+struct mbox_canaan_aggr_msg {
+    __u32   chan;
+    __u32   len;
+    __u8    data[MBOX_MAX_MSG_LEN];
+};
+
+/*
+ * Tx aggregation: small messages are staged and written to the window as
+ * one batch with a single doorbell. The batch is
+ *   u32 MBOX_AGGR_MAGIC, u8 count, then count times { u8 len, u8 data[len] }
+ * so the DSP can tell it from a plain message, and is sent when the next message does not fit, when max_bytes is
+ * reached or delay_us after the first message was staged.
+ */
+#define MBOX_AGGR_MAGIC         0x41474d42  /* "BMGA" */
+#define MBOX_AGGR_COUNT         4           /* offset of the count */
+#define MBOX_AGGR_HDR_LEN       5
+/* failed sends of one batch before its messages are dropped */
+#define MBOX_AGGR_MAX_RETRIES   3
+/*
+ * Two batch buffers: lock covers staging into batch, send_lock covers
+ * flight, the batch being sent. A flush swaps them under lock and sends
+ * under send_lock only, so staging never waits for a txdone.
+ */
+struct mbox_canaan_aggr {
+    struct mutex                        lock;
+    struct mutex                        send_lock;
+    struct delayed_work                 work;
+    struct mbox_canaan_client_device    *client_dev;
+    int                                 chan_index;
+    bool                                enable;
+    u32                                 delay_us;
+    u32                                 max_bytes;
+    u32                                 used;
+    u8                                  *batch;
+    u8                                  *flight;
+    u32                                 flight_len;
+    u32                                 retries;
+    u32                                 messages;
+    u32                                 batches;
+    u32                                 dropped;
+};
+
+/* MBOX_SNAPSHOT_CONFIG argument, offset and size locate the window in the mmap */
+struct mbox_canaan_snapshot_config {
+    __u32   chan;
+    __u32   enable;
+    __u32   offset;
+    __u32   size;
+};
+
+/*
+ * Layout of an rx window in snapshot mode. The DSP makes seq odd, writes
+ * len and data, then makes seq even again. Readers mmap the window at
+ * offset chan * PAGE_SIZE and retry while seq is odd or has changed.
+ * The mode belongs to the channel, not to the opener: it stays until
+ * MBOX_SNAPSHOT_CONFIG turns it off again, closing the device keeps it.
+ */
+struct mbox_canaan_snapshot {
+    u32     seq;
+    u32     len;
+    u8      data[];
+};
+
+#define MBOX_SNAPSHOT_RETRY     100
+
+/*
+ * MBOX_PERIODIC_START argument. The first doorbell is rung start_ns from
+ * now, or one period from now if 0, then every period_ns. depth is the
+ * number of staged messages, a power of two up to MBOX_PERIODIC_MAX_DEPTH.
+ */
+struct mbox_canaan_periodic_config {
+    __u32   chan;
+    __u32   depth;
+    __u64   period_ns;
+    __u64   start_ns;
+};
+
+/* MBOX_PERIODIC_QUEUE argument */
+struct mbox_canaan_periodic_msg {
+    __u32   chan;
+    __u8    data[MBOX_MAX_MSG_LEN];
+};
+
+#define MBOX_PERIODIC_MAX_DEPTH 256
+#define MBOX_JITTER_BUCKETS     16
+
+/*
+ * MBOX_PERIODIC_STATS argument. underruns counts ticks with nothing
+ * staged, missed counts ticks skipped because the previous message was
+ * not acked yet or the timer itself ran late by a whole period. timeouts
+ * counts a last message still not acked when the mode was stopped. Jitter
+ * is the distance of each tick from its ideal time, jitter_hist[0] counts
+ * below 1 us and jitter_hist[i] [2^(i-1), 2^i) us, the last bucket beyond.
+ */
+struct mbox_canaan_periodic_stats {
+    __u32   chan;
+    __u32   sent;
+    __u32   underruns;
+    __u32   missed;
+    __u32   timeouts;
+    __u32   reserved;
+    __u64   jitter_max_ns;
+    __u32   jitter_hist[MBOX_JITTER_BUCKETS];
+};
+
+/*
+ * Periodic mode owns the channel through its own non-blocking client, the
+ * blocking one of the channel is given back on stop.
+ */
+struct mbox_canaan_periodic {
+    struct mbox_client                  client;
+    struct hrtimer                      timer;
+    spinlock_t                          lock;
+    bool                                running;
+    bool                                inflight;
+    wait_queue_head_t                   idle;
+    ktime_t                             period;
+    u32                                 depth;
+    u32                                 head;
+    u32                                 tail;
+    u8                                  *ring;
+    u8                                  msg[MBOX_MAX_MSG_LEN];
+    struct mbox_canaan_periodic_stats   stats;
+};
+
+/*
+ * Shared heap over the "memory-region" of the client node. The first page
+ * holds a struct mbox_canaan_heap_header for the DSP, the rest is the data
+ * area, split evenly between the size classes. Offsets exchanged with
+ * userspace and the DSP are relative to the start of the data area, which
+ * userspace maps at MBOX_HEAP_PGOFF pages into the device.
+ *
+ * Every block has an owner: the file that allocated it, or the DSP once
+ * that file hands it off with MBOX_HEAP_HANDOFF. Only the owner can free
+ * it, a file by MBOX_HEAP_FREE or by closing, the DSP by a free message.
+ * The DSP cannot allocate, it only uses and returns what it is given.
+ * A file can only map the pages whose blocks all belong to it, they are
+ * unmapped again when it frees or hands off one of them.
+ */
+#define MBOX_HEAP_PGOFF         0x1000
+#define MBOX_HEAP_CLASSES       6
+#define MBOX_HEAP_MIN_BLOCK     64  /* classes grow by 4x from here */
+#define MBOX_HEAP_MAGIC         0x48484d42  /* "BMHH", header */
+#define MBOX_HEAP_FREE_MAGIC    0x46484d42  /* "BMHF", dsp -> cpu batched free */
+
+/* MBOX_HEAP_ALLOC argument, offset is returned to userspace */
+struct mbox_canaan_heap_alloc {
+    __u32   size;
+    __u32   offset;
+};
+
+/* written once at probe, area_offset is relative to the data area */
+struct mbox_canaan_heap_header {
+    u32     magic;
+    u32     nr_classes;
+    u32     data_offset;
+    u32     data_size;
+    struct {
+        u32 block_size;
+        u32 count;
+        u32 area_offset;
+        u32 reserved;
+    } class[MBOX_HEAP_CLASSES];
+};
+
+/* the DSP gives buffers back on the control channel, count offsets at a time */
+struct mbox_canaan_heap_free_msg {
+    u32     magic;
+    u32     count;
+    u32     offset[6];
+};
+
+struct mbox_canaan_heap_class {
+    u32                 block_size;
+    u32                 count;
+    u32                 area_offset;
+    unsigned long       *map;
+    void                **owner;
+    unsigned long       hint;
+    atomic_t            used;
+};
+
+/*
+ * Clock correlation over the channel pair named by "canaan,timesync-chan"
+ * = <tx rx>. Every MBOX_TIMESYNC_PERIOD_MS the CPU sends t1, the DSP
+ * echoes it with MBOX_TIMESYNC_REPLY_MAGIC, its receive time t2 and send
+ * time t3 in nanoseconds of its own timebase, and the CPU takes t4 on
+ * arrival. Of each MBOX_TIMESYNC_WINDOW exchanges the one with the
+ * smallest delay is kept, drift comes from successive kept exchanges.
+ */
+#define MBOX_TIMESYNC_MAGIC         0x53544d42  /* "BMTS", cpu -> dsp */
+#define MBOX_TIMESYNC_REPLY_MAGIC   0x52544d42  /* "BMTR", dsp -> cpu */
+#define MBOX_TIMESYNC_PERIOD_MS     100
+#define MBOX_TIMESYNC_WINDOW        8
+/* one message per exchange, reused only long after a timed out send of it */
+#define MBOX_TIMESYNC_SLOTS         8
+/*
+ * kept exchanges further apart, or disagreeing with the CPU clock by more
+ * than this, mean the DSP timebase jumped (e.g. a DSP reset): start over
+ */
+#define MBOX_TIMESYNC_MAX_PPM       500
+#define MBOX_TIMESYNC_MAX_GAP_MS    10000
+
+struct mbox_canaan_timesync_msg {
+    u32     magic;
+    u32     seq;
+    u64     t1;
+    u64     t2;
+    u64     t3;
+};
+
+/* MBOX_TIMESYNC_CONVERT argument, cpu_ns is returned in CLOCK_MONOTONIC */
+struct mbox_canaan_timesync_convert {
+    __u64   dsp_ns;
+    __u64   cpu_ns;
+};
+
+struct mbox_canaan_timesync {
+    struct mbox_canaan_chan             *tx;
+    struct mbox_canaan_chan             *rx;
+    struct delayed_work                 work;
+    struct mbox_canaan_timesync_msg     msg[MBOX_TIMESYNC_SLOTS];
+    seqlock_t                           lock;
+    u32                                 seq;
+    bool                                pending;
+    u32                                 samples;
+    u32                                 lost;
+    u32                                 resyncs;
+    u32                                 window;
+    s64                                 best_delay;
+    s64                                 best_cpu;
+    s64                                 best_dsp;
+    s64                                 last_delay;
+    /* current estimate, dsp = ref_dsp + (cpu - ref_cpu) * (1 + drift_ppb / 1e9) */
+    bool                                valid;
+    s64                                 ref_cpu;
+    s64                                 ref_dsp;
+    s64                                 drift_ppb;
+    s64                                 min_delay;
+};
+
+struct mbox_canaan_heap {
+    void                            *base;
+    phys_addr_t                     phys;
+    size_t                          size;
+    struct mbox_canaan_heap_class   class[MBOX_HEAP_CLASSES];
+    /* orders ownership checks in mmap against unmapping on free */
+    struct mutex                    map_lock;
+    atomic_t                        failed;
+    atomic_t                        dsp_frees;
+    atomic_t                        bad_frees;
+};
+
+struct mbox_canaan_rx_msg {
+    u8  data[MBOX_MAX_MSG_LEN];
+};
+
+struct mbox_canaan_dmabuf_entry {
+    struct list_head            node;
+    u32                         handle;
+    bool                        released;
+    struct dma_buf              *dmabuf;
+    struct dma_buf_attachment   *attach;
+    struct sg_table             *sgt;
+};
+
+/*
+ * Per channel state, each channel on its own cache lines so the irq path
+ * of one channel and the ioctl path of another do not false share. The
+ * part written on every rx interrupt starts a new cache line as well.
+ */
+struct mbox_canaan_chan {
+    struct mbox_client      client;
+    int                     index;
+    u8                      dir;
+    void __iomem            *mmio;
+    phys_addr_t             phys;
+    resource_size_t         size;
+    struct mbox_chan        *channel;
+    u32                     verdict;
+    bool                    snapshot;
+    /*
+     * held for read around every send from process context, for write
+     * while switching the channel in or out of periodic or aggregation
+     * mode, so the channel never changes clients under a blocking send
+     */
+    struct rw_semaphore     tx_sem;
+    /*
+     * MBOX_CHAN_n_TX sends from here, one sender at a time. A send that
+     * timed out can stay queued in the mailbox core after the ioctl
+     * returned, so the message must not live on the stack.
+     */
+    struct mutex            tx_lock;
+    u8                      tx_buffer[MBOX_MAX_MSG_LEN];
+    struct mbox_canaan_aggr aggr;
+    struct mbox_canaan_periodic periodic;
+
+    spinlock_t              lock ____cacheline_aligned_in_smp;
+    bool                    data_ready;
+    u8                      rx_buffer[MBOX_MAX_MSG_LEN];
+    /* messages other channels redirected here, read before rx_buffer */
+    DECLARE_KFIFO(redirect, struct mbox_canaan_rx_msg, MBOX_RX_REDIRECT_DEPTH);
+    wait_queue_head_t       waitq;
+    u32                     delivered;
+    u32                     dropped;
+    u32                     redirected;
+    u32                     redirect_overflow;
+    u32                     snapshot_notify;
+} ____cacheline_aligned_in_smp;
+
+struct mbox_canaan_client_device {
+    struct device               *dev;
+    /*
+     * Channels come from the "mbox-names" of the DT node, "tx_chan_N" or
+     * "rx_chan_N" with N below MBOX_CHAN_NUM, in any mix of directions.
+     * chans holds them in DT order, the tables are indexed by N.
+     */
+    struct mbox_canaan_chan     *chans;
+    int                         num_chans;
+    struct mbox_canaan_chan     *tx_channel[MBOX_CHAN_NUM];
+    struct mbox_canaan_chan     *rx_channel[MBOX_CHAN_NUM];
+    struct fasync_struct        *async_queue;
+    dev_t                       devid;
+    struct cdev                 cdev;
+    struct class                *class;
+    struct dentry               *debugfs;
+    struct rchan                *capture;
+    spinlock_t                  capture_lock;
+    bool                        capture_enable;
+    u32                         capture_seq;
+    u32                         capture_dropped;
+    struct list_head            dmabuf_list;
+    struct list_head            dmabuf_done;
+    spinlock_t                  dmabuf_lock;
+    u32                         dmabuf_handle;
+    u32                         dmabuf_unknown;
+    wait_queue_head_t           dmabuf_waitq;
+    /*
+     * rx channel reserved for driver level replies from the DSP, only
+     * there are magic words decoded, never on channels userspace reads
+     */
+    struct mbox_canaan_chan     *ctrl;
+    u32                         ctrl_unknown;
+    struct work_struct          dmabuf_work;
+    struct mbox_canaan_heap     heap;
+    struct mbox_canaan_timesync timesync;
+};
+
+/*
+ * per open file. rx_mask selects the rx channels poll() reports on, bit n
+ * for channel n, all of them by default.
+ */
+struct mbox_canaan_file {
+    struct mbox_canaan_client_device    *client_dev;
+    u32                                 rx_mask;
+};
+
+
+static struct mbox_canaan_chan *to_canaan_chan(struct mbox_client *client)
+{
+    return container_of(client, struct mbox_canaan_chan, client);
+}
+
+static struct mbox_canaan_client_device *to_client_dev(struct file *filp)
+{
+    struct mbox_canaan_file *file = filp->private_data;
+
+    return file->client_dev;
+}
+
+static struct mbox_canaan_chan *mbox_canaan_tx_chan(struct mbox_canaan_client_device *client_dev,
+                                                    unsigned long chan_index)
+{
+    if (chan_index >= MBOX_CHAN_NUM)
+        return NULL;
+
+    return client_dev->tx_channel[chan_index];
+}
+
+static struct mbox_canaan_chan *mbox_canaan_rx_chan(struct mbox_canaan_client_device *client_dev,
+                                                    unsigned long chan_index)
+{
+    if (chan_index >= MBOX_CHAN_NUM)
+        return NULL;
+
+    return client_dev->rx_channel[chan_index];
+}
+
+/* traffic capture */
+
+static struct dentry *mbox_canaan_capture_create_buf_file(const char *filename,
+                                    struct dentry *parent, umode_t mode,
+                                    struct rchan_buf *buf, int *is_global)
+{
+    /* one global buffer keeps the records of all cpus in time order */
+    *is_global = 1;
+
+    return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int mbox_canaan_capture_remove_buf_file(struct dentry *dentry)
+{
+    debugfs_remove(dentry);
+
+    return 0;
+}
+
+static int mbox_canaan_capture_subbuf_start(struct rchan_buf *buf, void *subbuf,
+                                    void *prev_subbuf, size_t prev_padding)
+{
+    struct mbox_canaan_client_device *client_dev = buf->chan->private_data;
+
+    /* never overwrite records the reader has not consumed yet */
+    if (relay_buf_full(buf))
+    {
+        client_dev->capture_dropped++;
+        return 0;
+    }
+
+    return 1;
+}
+
+static struct rchan_callbacks mbox_canaan_capture_callbacks = {
+    .subbuf_start       = mbox_canaan_capture_subbuf_start,
+    .create_buf_file    = mbox_canaan_capture_create_buf_file,
+    .remove_buf_file    = mbox_canaan_capture_remove_buf_file,
+};
+
+static void mbox_canaan_capture(struct mbox_canaan_client_device *client_dev,
+                                int chan_index, u8 dir, const void *payload)
+{
+    struct mbox_canaan_capture_record rec;
+    unsigned long flags;
+
+    if (!READ_ONCE(client_dev->capture_enable) || !client_dev->capture)
+        return;
+
+    rec.chan = chan_index;
+    rec.dir = dir;
+    rec.reserved = 0;
+    memcpy(rec.payload, payload, MBOX_MAX_MSG_LEN);
+
+    /* stamp under the lock so timestamps never go backwards against seq */
+    spin_lock_irqsave(&client_dev->capture_lock, flags);
+    rec.timestamp = ktime_get_ns();
+    rec.seq = client_dev->capture_seq++;
+    __relay_write(client_dev->capture, &rec, sizeof(rec));
+    spin_unlock_irqrestore(&client_dev->capture_lock, flags);
+}
+
+/* rx filter */
+
+__diag_push();
+__diag_ignore_all("-Wmissing-prototypes", "kfuncs are only called from BPF");
+
+/*
+ * Sets the verdict from a tp_btf program attached to the
+ * mbox_canaan_rx_filter tracepoint. The program looks at ctx->payload and
+ * may copy it into a BPF ring buffer itself before dropping it.
+ */
+__bpf_kfunc int bpf_mbox_canaan_rx_verdict(struct mbox_canaan_rx_ctx *ctx,
+                                    enum mbox_canaan_rx_action action, u32 target)
+{
+    if (action > MBOX_RX_ACTION_REDIRECT)
+        return -EINVAL;
+    if (action == MBOX_RX_ACTION_REDIRECT && target >= MBOX_CHAN_NUM)
+        return -EINVAL;
+
+    ctx->action = action;
+    ctx->target = target;
+    ctx->from_bpf = true;
+
+    return 0;
+}
+
+__diag_pop();
+
+BTF_SET8_START(mbox_canaan_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_mbox_canaan_rx_verdict)
+BTF_SET8_END(mbox_canaan_kfunc_ids)
+
+static const struct btf_kfunc_id_set mbox_canaan_kfunc_set = {
+    .owner = THIS_MODULE,
+    .set = &mbox_canaan_kfunc_ids,
+};
+
+/*
+ * Runs in rx_callback before userspace is woken. ctx starts with the
+ * default verdict of the channel (debugfs rx_verdict_N), the tracepoint
+ * lets BPF replace it.
+ */
+static void mbox_canaan_rx_filter(struct mbox_canaan_client_device *client_dev,
+                                    struct mbox_canaan_rx_ctx *ctx)
+{
+    u32 verdict = READ_ONCE(client_dev->rx_channel[ctx->chan]->verdict);
+
+    ctx->action = MBOX_RX_ACTION_PASS;
+    ctx->target = 0;
+    ctx->from_bpf = false;
+    if (verdict != MBOX_RX_PASS)
+    {
+        ctx->action = MBOX_RX_ACTION_DROP;
+        if ((verdict & ~MBOX_RX_REDIRECT_MASK) == MBOX_RX_REDIRECT)
+        {
+            ctx->action = MBOX_RX_ACTION_REDIRECT;
+            ctx->target = verdict & MBOX_RX_REDIRECT_MASK;
+        }
+    }
+
+    trace_mbox_canaan_rx_filter(ctx);
+
+    /* a stale debugfs verdict silently eats all traffic of the channel */
+    if (!ctx->from_bpf && verdict != MBOX_RX_PASS)
+        dev_warn_ratelimited(client_dev->dev, "rx channel %d verdict %#x, not delivering\n",
+                                ctx->chan, verdict);
+}
+
+static int mbox_canaan_rx_filter_show(struct seq_file *s, void *unused)
+{
+    struct mbox_canaan_client_device *client_dev = s->private;
+    struct mbox_canaan_chan *chan;
+    int i;
+
+    seq_puts(s, "chan  verdict  delivered  dropped  redirected  queued  overflow  snapshot_notify\n");
+    for (i = 0; i < MBOX_CHAN_NUM; i++)
+    {
+        chan = client_dev->rx_channel[i];
+        if (!chan)
+            continue;
+        seq_printf(s, "%4d  %7x  %9u  %7u  %10u  %6u  %8u  %15u\n", i, chan->verdict,
+                    chan->delivered, chan->dropped, chan->redirected,
+                    kfifo_len(&chan->redirect), chan->redirect_overflow,
+                    chan->snapshot_notify);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mbox_canaan_rx_filter);
+
+/* snapshot */
+
+/*
+ * seqlock style read of the snapshot data, at most max bytes. buf gets
+ * data[0..len) of the window zero padded to max, like a normal rx buffer.
+ */
+static int mbox_canaan_snapshot_read(struct mbox_canaan_chan *chan, void *buf, size_t max)
+{
+    void __iomem *seq_reg = chan->mmio + offsetof(struct mbox_canaan_snapshot, seq);
+    void __iomem *len_reg = chan->mmio + offsetof(struct mbox_canaan_snapshot, len);
+    void __iomem *data = chan->mmio + offsetof(struct mbox_canaan_snapshot, data);
+    size_t room = min_t(size_t, max, chan->size - sizeof(struct mbox_canaan_snapshot));
+    int retry = MBOX_SNAPSHOT_RETRY;
+    size_t len;
+    u32 seq;
+
+    do
+    {
+        seq = readl(seq_reg);
+        if (seq & 1)
+        {
+            cpu_relax();
+            continue;
+        }
+        rmb();
+        len = min_t(size_t, readl(len_reg), room);
+        memcpy_fromio(buf, data, len);
+        rmb();
+        if (readl(seq_reg) == seq)
+        {
+            memset(buf + len, 0, max - len);
+            return 0;
+        }
+    } while (--retry);
+
+    return -EBUSY;
+}
+
+static int mbox_canaan_snapshot_config(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_snapshot_config config;
+    struct mbox_canaan_chan *chan;
+    unsigned long flags;
+
+    /* the mode belongs to the channel and changes what every reader gets */
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+        return -EFAULT;
+
+    chan = mbox_canaan_rx_chan(client_dev, config.chan);
+    if (!chan || !chan->mmio || chan->size < sizeof(struct mbox_canaan_snapshot))
+    {
+        dev_err(client_dev->dev, "Channel cannot do Rx\n");
+        return -EINVAL;
+    }
+
+    spin_lock_irqsave(&chan->lock, flags);
+    WRITE_ONCE(chan->snapshot, !!config.enable);
+    /* redirects are refused from now on, the queued ones are never read */
+    if (config.enable)
+        kfifo_reset(&chan->redirect);
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+    config.offset = offset_in_page(chan->phys);
+    config.size = chan->size;
+    if (copy_to_user((void __user *)arg, &config, sizeof(config)))
+        return -EFAULT;
+
+    return 0;
+}
+
+/* shared heap */
+
+/* owner of the blocks handed off to the DSP */
+#define MBOX_HEAP_OWNER_DSP(heap)   ((void *)(heap))
+
+static int mbox_canaan_heap_alloc(struct mbox_canaan_heap *heap, u32 size,
+                                void *owner, u32 *offset)
+{
+    struct mbox_canaan_heap_class *class;
+    unsigned long bit, hint;
+    int first, i;
+
+    for (first = 0; first < MBOX_HEAP_CLASSES; first++)
+    {
+        if (heap->class[first].block_size >= size)
+            break;
+    }
+
+    /* a full class spills into the next one only, so waste stays below 16x */
+    for (i = first; i < min(first + 2, MBOX_HEAP_CLASSES); i++)
+    {
+        class = &heap->class[i];
+        if (!class->count)
+            continue;
+
+        hint = READ_ONCE(class->hint);
+        if (hint >= class->count)
+            hint = 0;
+        bit = find_next_zero_bit(class->map, class->count, hint);
+        if (bit >= class->count)
+            bit = find_first_zero_bit(class->map, class->count);
+
+        while (bit < class->count)
+        {
+            if (!test_and_set_bit(bit, class->map))
+            {
+                WRITE_ONCE(class->owner[bit], owner);
+                WRITE_ONCE(class->hint, bit + 1);
+                atomic_inc(&class->used);
+                *offset = class->area_offset + bit * class->block_size;
+                /* the block may still hold the data of its last owner */
+                memset(heap->base + PAGE_SIZE + *offset, 0, class->block_size);
+                return 0;
+            }
+            bit = find_next_zero_bit(class->map, class->count, bit + 1);
+        }
+    }
+
+    atomic_inc(&heap->failed);
+
+    return -ENOMEM;
+}
+
+/* class and index of the block starting at offset, NULL if there is none */
+static struct mbox_canaan_heap_class *mbox_canaan_heap_block(struct mbox_canaan_heap *heap,
+                                                            u32 offset, u32 *index)
+{
+    struct mbox_canaan_heap_class *class;
+    u32 pos;
+    int i;
+
+    for (i = 0; i < MBOX_HEAP_CLASSES; i++)
+    {
+        class = &heap->class[i];
+        if (offset < class->area_offset)
+            continue;
+        pos = offset - class->area_offset;
+        if (pos >= class->count * class->block_size)
+            continue;
+        if (pos % class->block_size)
+            return NULL;
+        *index = pos / class->block_size;
+        return class;
+    }
+
+    return NULL;
+}
+
+/* moves the block from owner to new_owner, a NULL new_owner frees it */
+static int mbox_canaan_heap_give(struct mbox_canaan_heap *heap, u32 offset,
+                                void *owner, void *new_owner)
+{
+    struct mbox_canaan_heap_class *class;
+    u32 index;
+
+    class = mbox_canaan_heap_block(heap, offset, &index);
+    if (!class || cmpxchg(&class->owner[index], owner, new_owner) != owner)
+    {
+        atomic_inc(&heap->bad_frees);
+        return -EINVAL;
+    }
+
+    if (!new_owner)
+    {
+        clear_bit(index, class->map);
+        atomic_dec(&class->used);
+    }
+
+    return 0;
+}
+
+/* frees everything a closing file still owns, blocks handed off stay */
+static void mbox_canaan_heap_release(struct mbox_canaan_heap *heap, void *owner)
+{
+    struct mbox_canaan_heap_class *class;
+    unsigned long bit;
+    int i;
+
+    if (!heap->base)
+        return;
+
+    for (i = 0; i < MBOX_HEAP_CLASSES; i++)
+    {
+        class = &heap->class[i];
+        for_each_set_bit(bit, class->map, class->count)
+        {
+            if (cmpxchg(&class->owner[bit], owner, NULL) != owner)
+                continue;
+            clear_bit(bit, class->map);
+            atomic_dec(&class->used);
+        }
+    }
+}
+
+/* called for the control channel, returns true if the message was a batched free */
+static bool mbox_canaan_heap_reply(struct mbox_canaan_client_device *client_dev,
+                                    const void *message)
+{
+    const struct mbox_canaan_heap_free_msg *msg = message;
+    struct mbox_canaan_heap *heap = &client_dev->heap;
+    u32 i;
+
+    if (!heap->base || msg->magic != MBOX_HEAP_FREE_MAGIC)
+        return false;
+
+    for (i = 0; i < min_t(u32, msg->count, ARRAY_SIZE(msg->offset)); i++)
+    {
+        if (!mbox_canaan_heap_give(heap, msg->offset[i], MBOX_HEAP_OWNER_DSP(heap), NULL))
+            atomic_inc(&heap->dsp_frees);
+    }
+
+    return true;
+}
+
+static int mbox_canaan_heap_ioctl_alloc(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_heap_alloc req;
+    int ret;
+
+    if (!client_dev->heap.base)
+        return -ENODEV;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+
+    if (!req.size)
+        return -EINVAL;
+
+    ret = mbox_canaan_heap_alloc(&client_dev->heap, req.size, filp->private_data,
+                                &req.offset);
+    if (ret)
+        return ret;
+
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+    {
+        mbox_canaan_heap_give(&client_dev->heap, req.offset, filp->private_data, NULL);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/* MBOX_HEAP_FREE frees a block of this file, MBOX_HEAP_HANDOFF gives it to the DSP */
+static int mbox_canaan_heap_ioctl_give(struct file *filp, unsigned long arg, bool dsp)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_heap *heap = &client_dev->heap;
+    struct mbox_canaan_heap_class *class;
+    u32 offset, index;
+    loff_t start, end;
+    int ret;
+
+    if (!heap->base)
+        return -ENODEV;
+
+    if (get_user(offset, (u32 __user *)arg))
+        return -EFAULT;
+
+    mutex_lock(&heap->map_lock);
+    ret = mbox_canaan_heap_give(heap, offset, filp->private_data,
+                                dsp ? MBOX_HEAP_OWNER_DSP(heap) : NULL);
+    if (!ret)
+    {
+        /* the pages of the block are no longer wholly ours */
+        class = mbox_canaan_heap_block(heap, offset, &index);
+        start = round_down(offset, PAGE_SIZE);
+        end = round_up(offset + class->block_size, PAGE_SIZE);
+        unmap_mapping_range(filp->f_mapping,
+                            ((loff_t)MBOX_HEAP_PGOFF << PAGE_SHIFT) + start,
+                            end - start, 1);
+    }
+    mutex_unlock(&heap->map_lock);
+
+    return ret;
+}
+
+/* true if every block in the page at pos of the data area belongs to owner */
+static bool mbox_canaan_heap_page_owned(struct mbox_canaan_heap *heap, u32 pos, void *owner)
+{
+    struct mbox_canaan_heap_class *class;
+    u32 first, last, index;
+    int i;
+
+    for (i = 0; i < MBOX_HEAP_CLASSES; i++)
+    {
+        class = &heap->class[i];
+        if (pos < class->area_offset ||
+            pos - class->area_offset >= class->count * class->block_size)
+            continue;
+
+        first = (pos - class->area_offset) / class->block_size;
+        last = min(class->count,
+                    DIV_ROUND_UP(pos - class->area_offset + PAGE_SIZE, class->block_size));
+        for (index = first; index < last; index++)
+        {
+            if (READ_ONCE(class->owner[index]) != owner)
+                return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static int mbox_canaan_heap_mmap(struct file *filp, struct mbox_canaan_heap *heap,
+                                struct vm_area_struct *vma)
+{
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long pgoff = vma->vm_pgoff - MBOX_HEAP_PGOFF;
+    size_t data_size = heap->size - PAGE_SIZE;
+    unsigned long pos;
+    int ret;
+
+    if (!heap->base)
+        return -ENODEV;
+
+    if (pgoff > data_size >> PAGE_SHIFT || len > data_size - (pgoff << PAGE_SHIFT))
+        return -EINVAL;
+
+    /* same attributes as the kernel mapping, the DSP does not snoop */
+    vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+    mutex_lock(&heap->map_lock);
+    for (pos = pgoff << PAGE_SHIFT; pos < (pgoff << PAGE_SHIFT) + len; pos += PAGE_SIZE)
+    {
+        if (!mbox_canaan_heap_page_owned(heap, pos, filp->private_data))
+        {
+            ret = -EACCES;
+            goto out;
+        }
+    }
+
+    ret = remap_pfn_range(vma, vma->vm_start,
+                            ((heap->phys + PAGE_SIZE) >> PAGE_SHIFT) + pgoff,
+                            len, vma->vm_page_prot);
+out:
+    mutex_unlock(&heap->map_lock);
+
+    return ret;
+}
+
+static int mbox_canaan_heap_show(struct seq_file *s, void *unused)
+{
+    struct mbox_canaan_client_device *client_dev = s->private;
+    struct mbox_canaan_heap *heap = &client_dev->heap;
+    struct mbox_canaan_heap_class *class;
+    int i;
+
+    if (!heap->base)
+        return 0;
+
+    seq_printf(s, "phys %pa size %zu failed %d dsp_frees %d bad_frees %d\n",
+                &heap->phys, heap->size, atomic_read(&heap->failed),
+                atomic_read(&heap->dsp_frees), atomic_read(&heap->bad_frees));
+    seq_puts(s, "block_size  count  used  area_offset\n");
+    for (i = 0; i < MBOX_HEAP_CLASSES; i++)
+    {
+        class = &heap->class[i];
+        seq_printf(s, "%10u  %5u  %4d  %11x\n", class->block_size, class->count,
+                    atomic_read(&class->used), class->area_offset);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mbox_canaan_heap);
+
+/* the heap is optional, without a memory-region its ioctls return -ENODEV */
+static int mbox_canaan_heap_init(struct platform_device *pdev,
+                                struct mbox_canaan_client_device *client_dev)
+{
+    struct mbox_canaan_heap *heap = &client_dev->heap;
+    struct mbox_canaan_heap_header *hdr;
+    struct mbox_canaan_heap_class *class;
+    struct device_node *rmem_np;
+    struct reserved_mem *rmem;
+    size_t share;
+    int i;
+
+    rmem_np = of_parse_phandle(pdev->dev.of_node, "memory-region", 0);
+    if (!rmem_np)
+        return 0;
+
+    rmem = of_reserved_mem_lookup(rmem_np);
+    of_node_put(rmem_np);
+    if (!rmem)
+    {
+        dev_err(&pdev->dev, "Invalid memory-region\n");
+        return -EINVAL;
+    }
+
+    /* page aligned shares keep every block naturally aligned up to a page */
+    share = rounddown((rmem->size - PAGE_SIZE) / MBOX_HEAP_CLASSES, PAGE_SIZE);
+    if (!PAGE_ALIGNED(rmem->base) || rmem->size <= PAGE_SIZE || !share)
+    {
+        dev_err(&pdev->dev, "memory-region too small or unaligned\n");
+        return -EINVAL;
+    }
+
+    heap->base = devm_memremap(&pdev->dev, rmem->base, rmem->size, MEMREMAP_WC);
+    if (IS_ERR(heap->base))
+    {
+        heap->base = NULL;
+        dev_err(&pdev->dev, "Failed to map memory-region\n");
+        return -ENOMEM;
+    }
+    heap->phys = rmem->base;
+    heap->size = rmem->size;
+    mutex_init(&heap->map_lock);
+
+    hdr = heap->base;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->nr_classes = MBOX_HEAP_CLASSES;
+    hdr->data_offset = PAGE_SIZE;
+    hdr->data_size = heap->size - PAGE_SIZE;
+
+    /* the bitmaps stay in kernel memory, the DSP only frees by message */
+    for (i = 0; i < MBOX_HEAP_CLASSES; i++)
+    {
+        class = &heap->class[i];
+        class->block_size = MBOX_HEAP_MIN_BLOCK << (2 * i);
+        class->count = share / class->block_size;
+        class->area_offset = i * share;
+        class->map = devm_kcalloc(&pdev->dev, BITS_TO_LONGS(class->count),
+                                sizeof(unsigned long), GFP_KERNEL);
+        class->owner = devm_kcalloc(&pdev->dev, class->count, sizeof(void *), GFP_KERNEL);
+        if (!class->map || !class->owner)
+        {
+            heap->base = NULL;
+            return -ENOMEM;
+        }
+
+        hdr->class[i].block_size = class->block_size;
+        hdr->class[i].count = class->count;
+        hdr->class[i].area_offset = class->area_offset;
+    }
+    wmb();
+    hdr->magic = MBOX_HEAP_MAGIC;
+
+    return 0;
+}
+
+static int mbox_canaan_client_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    unsigned long chan_index = vma->vm_pgoff;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    struct mbox_canaan_chan *chan;
+
+    if (vma->vm_pgoff >= MBOX_HEAP_PGOFF)
+        return mbox_canaan_heap_mmap(filp, &client_dev->heap, vma);
+
+    chan = mbox_canaan_rx_chan(client_dev, chan_index);
+    if (!chan || !chan->mmio || !READ_ONCE(chan->snapshot))
+        return -EINVAL;
+
+    /* only the DSP writes a snapshot */
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    if (len > PAGE_ALIGN(offset_in_page(chan->phys) + chan->size))
+        return -EINVAL;
+
+    /* a window sharing its pages would expose its neighbours as well */
+    if ((offset_in_page(chan->phys) || offset_in_page(chan->size)) &&
+        !capable(CAP_SYS_RAWIO))
+        return -EPERM;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+    return io_remap_pfn_range(vma, vma->vm_start, chan->phys >> PAGE_SHIFT,
+                            len, vma->vm_page_prot);
+}
+
+static int mbox_canaan_message_fasync(int fd, struct file *filp, int on)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+
+    return fasync_helper(fd, filp, on, &client_dev->async_queue);
+}
+
+/* ioctl function */
+static int mbox_canaan_message_copy_send(struct file *filp, int chan_index, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_chan *chan = mbox_canaan_tx_chan(client_dev, chan_index);
+    u8 data[MBOX_MAX_MSG_LEN];
+    int ret;
+
+    // printk("[%s,%d]", __func__, __LINE__);
+    if(!chan || !chan->channel)
+    {
+        dev_err(client_dev->dev, "Channel cannot do Tx\n");
+        return -EINVAL;
+    }
+
+    if (copy_from_user(data, (char *)arg, MBOX_MAX_MSG_LEN))
+        return -EFAULT;
+
+    // print_hex_dump(KERN_INFO, "Client: send [MMIO]: ", DUMP_PREFIX_ADDRESS, 16, 1,
+	// 				data, MBOX_MAX_MSG_LEN, true);
+
+    down_read(&chan->tx_sem);
+    if (chan->periodic.running)
+    {
+        ret = -EBUSY;
+    }
+    else
+    {
+        mutex_lock(&chan->tx_lock);
+        memcpy(chan->tx_buffer, data, MBOX_MAX_MSG_LEN);
+        ret = mbox_send_message(chan->channel, chan->tx_buffer);
+        mutex_unlock(&chan->tx_lock);
+    }
+    up_read(&chan->tx_sem);
+    if (ret < 0 && ret != -EBUSY)
+        dev_err(client_dev->dev, "Failed to send message via mailbox\n");
+
+    return ret < 0 ? ret : 0;
+}
+
+static int mbox_canaan_message_copy_received(struct file *filp, int chan_index, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_chan *chan = mbox_canaan_rx_chan(client_dev, chan_index);
+    u8 data[MBOX_MAX_MSG_LEN];
+    unsigned long flags;
+    int ret;
+
+    // printk("[%s,%d]", __func__, __LINE__);
+    if(!chan || !chan->channel)
+    {
+        dev_err(client_dev->dev, "Channel cannot do Rx\n");
+        return -EINVAL;
+    }
+
+    if (READ_ONCE(chan->snapshot))
+    {
+        ret = mbox_canaan_snapshot_read(chan, data, MBOX_MAX_MSG_LEN);
+        if (ret)
+            return ret;
+        spin_lock_irqsave(&chan->lock, flags);
+    }
+    else
+    {
+        spin_lock_irqsave(&chan->lock, flags);
+        if (kfifo_out(&chan->redirect, (struct mbox_canaan_rx_msg *)data, 1))
+        {
+            spin_unlock_irqrestore(&chan->lock, flags);
+            goto copy;
+        }
+        memcpy(data, chan->rx_buffer, MBOX_MAX_MSG_LEN);
+    }
+    chan->data_ready = false;
+    spin_unlock_irqrestore(&chan->lock, flags);
+
+copy:
+    ret = copy_to_user((char *)arg, data, MBOX_MAX_MSG_LEN);
+    if (ret) 
+        return -EFAULT;
+    
+    return 0;
+}
+
+/* dma-buf */
+
+static void mbox_canaan_dmabuf_put(struct mbox_canaan_dmabuf_entry *entry)
+{
+    dma_buf_unmap_attachment(entry->attach, entry->sgt, DMA_BIDIRECTIONAL);
+    dma_buf_detach(entry->dmabuf, entry->attach);
+    dma_buf_put(entry->dmabuf);
+    kfree(entry);
+}
+
+static void mbox_canaan_dmabuf_work(struct work_struct *work)
+{
+    struct mbox_canaan_client_device *client_dev =
+        container_of(work, struct mbox_canaan_client_device, dmabuf_work);
+    struct mbox_canaan_dmabuf_entry *entry, *tmp;
+    unsigned long flags;
+    LIST_HEAD(done);
+
+    spin_lock_irqsave(&client_dev->dmabuf_lock, flags);
+    list_splice_init(&client_dev->dmabuf_done, &done);
+    spin_unlock_irqrestore(&client_dev->dmabuf_lock, flags);
+
+    list_for_each_entry_safe(entry, tmp, &done, node)
+        mbox_canaan_dmabuf_put(entry);
+}
+
+/*
+ * called from rx_callback, returns true if the message was a release. A
+ * release for an unknown handle, e.g. one whose send timed out, is still
+ * consumed so it never reaches userspace as data.
+ */
+static bool mbox_canaan_dmabuf_reply(struct mbox_canaan_client_device *client_dev,
+                                    const void *message)
+{
+    const struct mbox_canaan_dmabuf_desc *desc = message;
+    struct mbox_canaan_dmabuf_entry *entry;
+    bool found = false;
+
+    if (desc->magic != MBOX_DMABUF_DONE_MAGIC)
+        return false;
+
+    spin_lock(&client_dev->dmabuf_lock);
+    list_for_each_entry(entry, &client_dev->dmabuf_list, node)
+    {
+        if (entry->handle == desc->handle)
+        {
+            /* unmapping may sleep, leave it to the work */
+            list_move_tail(&entry->node, &client_dev->dmabuf_done);
+            entry->released = true;
+            found = true;
+            break;
+        }
+    }
+    if (!found)
+        client_dev->dmabuf_unknown++;
+    spin_unlock(&client_dev->dmabuf_lock);
+
+    if (found)
+    {
+        schedule_work(&client_dev->dmabuf_work);
+        wake_up_interruptible(&client_dev->dmabuf_waitq);
+    }
+
+    return true;
+}
+
+/* handles only leave dmabuf_list once the DSP released them */
+static bool mbox_canaan_dmabuf_held(struct mbox_canaan_client_device *client_dev, u32 handle)
+{
+    struct mbox_canaan_dmabuf_entry *entry;
+    bool held = false;
+
+    spin_lock_irq(&client_dev->dmabuf_lock);
+    list_for_each_entry(entry, &client_dev->dmabuf_list, node)
+    {
+        if (entry->handle == handle)
+        {
+            held = true;
+            break;
+        }
+    }
+    spin_unlock_irq(&client_dev->dmabuf_lock);
+
+    return held;
+}
+
+static int mbox_canaan_dmabuf_wait(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_dmabuf_wait req;
+    long ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+
+    if (!req.handle || req.handle > READ_ONCE(client_dev->dmabuf_handle))
+        return -EINVAL;
+
+    if (!req.timeout_ms)
+        return mbox_canaan_dmabuf_held(client_dev, req.handle) ? -EBUSY : 0;
+
+    ret = wait_event_interruptible_timeout(client_dev->dmabuf_waitq,
+                                        !mbox_canaan_dmabuf_held(client_dev, req.handle),
+                                        msecs_to_jiffies(req.timeout_ms));
+    if (ret < 0)
+        return ret;
+
+    return ret ? 0 : -ETIMEDOUT;
+}
+
+/* the DSP has no iommu, so [offset, offset + length) must be dma contiguous */
+static int mbox_canaan_dmabuf_addr(struct sg_table *sgt, u32 offset, u32 length,
+                                    dma_addr_t *addr)
+{
+    struct scatterlist *sg;
+    dma_addr_t start = 0, next = 0;
+    u64 end = (u64)offset + length;
+    u64 pos = 0;
+    bool started = false;
+    int i;
+
+    for_each_sg(sgt->sgl, sg, sgt->nents, i)
+    {
+        if (pos + sg_dma_len(sg) <= offset)
+        {
+            pos += sg_dma_len(sg);
+            continue;
+        }
+
+        if (!started)
+        {
+            start = sg_dma_address(sg) + (offset > pos ? offset - pos : 0);
+            started = true;
+        }
+        else if (sg_dma_address(sg) != next)
+            return -EINVAL;
+
+        next = sg_dma_address(sg) + sg_dma_len(sg);
+        pos += sg_dma_len(sg);
+        if (pos >= end)
+        {
+            *addr = start;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static int mbox_canaan_dmabuf_send(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_dmabuf_entry *entry;
+    struct mbox_canaan_dmabuf_desc desc;
+    struct mbox_canaan_dmabuf req;
+    struct mbox_canaan_chan *chan;
+    dma_addr_t addr;
+    bool released;
+    int ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+
+    if (!req.length)
+        return -EINVAL;
+
+    chan = mbox_canaan_tx_chan(client_dev, req.chan);
+    if (!chan || !chan->channel)
+    {
+        dev_err(client_dev->dev, "Channel cannot do Tx\n");
+        return -EINVAL;
+    }
+
+    /* without the control channel the release would never be seen */
+    if (!client_dev->ctrl)
+        return -ENODEV;
+
+    if (READ_ONCE(chan->periodic.running))
+        return -EBUSY;  /* checked again under tx_sem, this only saves the mapping */
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry)
+        return -ENOMEM;
+
+    entry->dmabuf = dma_buf_get(req.fd);
+    if (IS_ERR(entry->dmabuf))
+    {
+        ret = PTR_ERR(entry->dmabuf);
+        goto err_free;
+    }
+
+    if ((u64)req.offset + req.length > entry->dmabuf->size)
+    {
+        ret = -EINVAL;
+        goto err_put;
+    }
+
+    /* map for the platform device, it is the one doing dma with the DSP */
+    entry->attach = dma_buf_attach(entry->dmabuf, chan->client.dev);
+    if (IS_ERR(entry->attach))
+    {
+        ret = PTR_ERR(entry->attach);
+        goto err_put;
+    }
+
+    entry->sgt = dma_buf_map_attachment(entry->attach, DMA_BIDIRECTIONAL);
+    if (IS_ERR(entry->sgt))
+    {
+        ret = PTR_ERR(entry->sgt);
+        goto err_detach;
+    }
+
+    ret = mbox_canaan_dmabuf_addr(entry->sgt, req.offset, req.length, &addr);
+    if (ret)
+    {
+        dev_err(client_dev->dev, "dma-buf is not contiguous\n");
+        goto err_unmap;
+    }
+
+    spin_lock_irq(&client_dev->dmabuf_lock);
+    entry->handle = ++client_dev->dmabuf_handle;
+    list_add_tail(&entry->node, &client_dev->dmabuf_list);
+    spin_unlock_irq(&client_dev->dmabuf_lock);
+
+    memset(&desc, 0, sizeof(desc));
+    desc.magic = MBOX_DMABUF_MAGIC;
+    desc.handle = entry->handle;
+    desc.addr = addr;
+    desc.length = req.length;
+
+    req.handle = entry->handle;
+    if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+    {
+        ret = -EFAULT;
+        goto err_unlink;
+    }
+
+    down_read(&chan->tx_sem);
+    if (chan->periodic.running)
+        ret = -EBUSY;
+    else
+        ret = mbox_send_message(chan->channel, &desc);
+    up_read(&chan->tx_sem);
+    if (ret < 0)
+    {
+        if (ret != -EBUSY)
+            dev_err(client_dev->dev, "Failed to send message via mailbox\n");
+        goto err_unlink;
+    }
+
+    return 0;
+
+err_unlink:
+    /* a timed out descriptor may still have reached the DSP and be released */
+    spin_lock_irq(&client_dev->dmabuf_lock);
+    released = entry->released;
+    if (!released)
+        list_del(&entry->node);
+    spin_unlock_irq(&client_dev->dmabuf_lock);
+    if (!released)
+        mbox_canaan_dmabuf_put(entry);
+    return ret;
+err_unmap:
+    dma_buf_unmap_attachment(entry->attach, entry->sgt, DMA_BIDIRECTIONAL);
+err_detach:
+    dma_buf_detach(entry->dmabuf, entry->attach);
+err_put:
+    dma_buf_put(entry->dmabuf);
+err_free:
+    kfree(entry);
+    return ret;
+}
+
+static void mbox_canaan_dmabuf_release_all(struct mbox_canaan_client_device *client_dev)
+{
+    struct mbox_canaan_dmabuf_entry *entry, *tmp;
+
+    cancel_work_sync(&client_dev->dmabuf_work);
+
+    list_splice_init(&client_dev->dmabuf_done, &client_dev->dmabuf_list);
+    list_for_each_entry_safe(entry, tmp, &client_dev->dmabuf_list, node)
+        mbox_canaan_dmabuf_put(entry);
+    INIT_LIST_HEAD(&client_dev->dmabuf_list);
+}
+
+/* tx aggregation */
+
+/*
+ * Sends the batch left behind by a failed flush. Called with send_lock
+ * held, after MBOX_AGGR_MAX_RETRIES failures the batch is dropped. A send
+ * that timed out has already been written to the window, so it is not
+ * sent a second time.
+ */
+static int mbox_canaan_aggr_send_flight(struct mbox_canaan_aggr *aggr)
+{
+    struct mbox_canaan_client_device *client_dev = aggr->client_dev;
+    struct mbox_canaan_chan *chan = container_of(aggr, struct mbox_canaan_chan, aggr);
+    int ret;
+
+    if (!aggr->flight_len)
+        return 0;
+
+    ret = mbox_send_message(chan->channel, aggr->flight);
+    if (ret >= 0)
+    {
+        aggr->batches++;
+        goto done;
+    }
+
+    dev_err(client_dev->dev, "Failed to send message via mailbox\n");
+    if (ret != -ETIME && ++aggr->retries < MBOX_AGGR_MAX_RETRIES)
+        return ret;
+
+    aggr->dropped += aggr->flight[MBOX_AGGR_COUNT];
+
+done:
+    aggr->flight_len = 0;
+    aggr->retries = 0;
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Called with tx_sem held, sends what a failed flush left behind and then
+ * whatever is staged. Staging goes on into the other buffer meanwhile.
+ */
+static int mbox_canaan_aggr_flush(struct mbox_canaan_aggr *aggr)
+{
+    struct mbox_canaan_chan *chan = container_of(aggr, struct mbox_canaan_chan, aggr);
+    u8 *batch;
+    int ret;
+
+    mutex_lock(&aggr->send_lock);
+    /* only a batch left behind by a failed flush can meet periodic mode */
+    if (chan->periodic.running)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    ret = mbox_canaan_aggr_send_flight(aggr);
+    if (ret)
+        goto out;
+
+    mutex_lock(&aggr->lock);
+    if (!aggr->batch || !aggr->batch[MBOX_AGGR_COUNT])
+    {
+        mutex_unlock(&aggr->lock);
+        goto out;
+    }
+    batch = aggr->flight;
+    aggr->flight = aggr->batch;
+    aggr->flight_len = aggr->used;
+    aggr->batch = batch;
+    aggr->batch[MBOX_AGGR_COUNT] = 0;
+    aggr->used = MBOX_AGGR_HDR_LEN;
+    mutex_unlock(&aggr->lock);
+
+    ret = mbox_canaan_aggr_send_flight(aggr);
+
+out:
+    mutex_unlock(&aggr->send_lock);
+
+    return ret;
+}
+
+static void mbox_canaan_aggr_work(struct work_struct *work)
+{
+    struct mbox_canaan_aggr *aggr =
+        container_of(to_delayed_work(work), struct mbox_canaan_aggr, work);
+    struct mbox_canaan_chan *chan = container_of(aggr, struct mbox_canaan_chan, aggr);
+
+    /* retries are bounded, a dropped batch leaves flight_len at 0 */
+    down_read(&chan->tx_sem);
+    if (mbox_canaan_aggr_flush(aggr) && READ_ONCE(aggr->flight_len) &&
+        READ_ONCE(aggr->enable))
+        schedule_delayed_work(&aggr->work, usecs_to_jiffies(aggr->delay_us));
+    up_read(&chan->tx_sem);
+}
+
+static int mbox_canaan_aggr_config(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_aggr_config config;
+    struct mbox_canaan_aggr *aggr;
+    struct mbox_canaan_chan *chan;
+    int ret = 0;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+        return -EFAULT;
+
+    chan = mbox_canaan_tx_chan(client_dev, config.chan);
+    if (!chan || !chan->channel || !chan->mmio)
+    {
+        dev_err(client_dev->dev, "Channel cannot do Tx\n");
+        return -EINVAL;
+    }
+
+    if (!config.max_bytes || config.max_bytes > chan->size)
+        config.max_bytes = chan->size;
+    /* room for the header and at least one full message */
+    if (config.max_bytes < MBOX_AGGR_HDR_LEN + 1 + MBOX_MAX_MSG_LEN)
+        return -EINVAL;
+
+    aggr = &chan->aggr;
+
+    /* the write side keeps senders and the work out, flush needs aggr->lock itself */
+    down_write(&chan->tx_sem);
+    if (aggr->batch)
+        ret = mbox_canaan_aggr_flush(aggr);
+    mutex_lock(&aggr->lock);
+    if (!config.enable)
+    {
+        aggr->enable = false;
+        goto out;
+    }
+
+    /* a periodic channel cannot also send batches */
+    if (chan->periodic.running)
+    {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    if (!aggr->batch)
+    {
+        aggr->batch = kzalloc(2 * chan->size, GFP_KERNEL);
+        if (!aggr->batch)
+        {
+            ret = -ENOMEM;
+            goto out;
+        }
+        aggr->flight = aggr->batch + chan->size;
+        *(u32 *)aggr->batch = MBOX_AGGR_MAGIC;
+        *(u32 *)aggr->flight = MBOX_AGGR_MAGIC;
+        aggr->used = MBOX_AGGR_HDR_LEN;
+    }
+
+    aggr->delay_us = config.delay_us;
+    aggr->max_bytes = config.max_bytes;
+    aggr->enable = true;
+
+out:
+    mutex_unlock(&aggr->lock);
+    up_write(&chan->tx_sem);
+    /* the work takes tx_sem itself */
+    if (!config.enable)
+        cancel_delayed_work_sync(&aggr->work);
+
+    return ret;
+}
+
+static int mbox_canaan_aggr_send(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_aggr_msg msg;
+    struct mbox_canaan_aggr *aggr;
+    struct mbox_canaan_chan *chan;
+    bool full;
+    int ret = 0;
+
+    if (copy_from_user(&msg, (void __user *)arg, sizeof(msg)))
+        return -EFAULT;
+
+    chan = mbox_canaan_tx_chan(client_dev, msg.chan);
+    if (!chan || !msg.len || msg.len > MBOX_MAX_MSG_LEN)
+        return -EINVAL;
+
+    aggr = &chan->aggr;
+
+    down_read(&chan->tx_sem);
+    for (;;)
+    {
+        mutex_lock(&aggr->lock);
+        if (!aggr->enable)
+        {
+            ret = -EINVAL;
+            goto out_unlock;
+        }
+        if (aggr->used + 1 + msg.len <= aggr->max_bytes &&
+            aggr->batch[MBOX_AGGR_COUNT] < U8_MAX)
+            break;
+        mutex_unlock(&aggr->lock);
+
+        /* if the staged batch cannot be sent this message is not taken */
+        ret = mbox_canaan_aggr_flush(aggr);
+        if (ret)
+            goto out;
+    }
+
+    aggr->batch[aggr->used++] = msg.len;
+    memcpy(aggr->batch + aggr->used, msg.data, msg.len);
+    aggr->used += msg.len;
+    aggr->messages++;
+
+    /* the first message staged starts the delay, like Nagle */
+    if (aggr->batch[MBOX_AGGR_COUNT]++ == 0)
+        schedule_delayed_work(&aggr->work, usecs_to_jiffies(aggr->delay_us));
+
+    full = aggr->used + 2 > aggr->max_bytes;
+    mutex_unlock(&aggr->lock);
+
+    /* the message is staged either way, a failed flush is retried by the work */
+    if (full && mbox_canaan_aggr_flush(aggr))
+        schedule_delayed_work(&aggr->work, usecs_to_jiffies(aggr->delay_us));
+    up_read(&chan->tx_sem);
+
+    return 0;
+
+out_unlock:
+    mutex_unlock(&aggr->lock);
+out:
+    up_read(&chan->tx_sem);
+
+    return ret;
+}
+
+/* number of bytes tx_prepare must write for this message */
+static size_t mbox_canaan_tx_len(struct mbox_canaan_chan *chan, const void *message)
+{
+    struct mbox_canaan_aggr *aggr = &chan->aggr;
+
+    if (message == aggr->flight)
+        return aggr->flight_len;
+
+    return MBOX_MAX_MSG_LEN;
+}
+
+static void mbox_canaan_capture_batch(struct mbox_canaan_client_device *client_dev,
+                                    int chan_index, const u8 *batch)
+{
+    u8 payload[MBOX_MAX_MSG_LEN];
+    const u8 *p = batch + MBOX_AGGR_HDR_LEN;
+    int i;
+
+    if (!READ_ONCE(client_dev->capture_enable))
+        return;
+
+    for (i = 0; i < batch[MBOX_AGGR_COUNT]; i++)
+    {
+        memset(payload, 0, sizeof(payload));
+        memcpy(payload, p + 1, p[0]);
+        mbox_canaan_capture(client_dev, chan_index, MBOX_DIR_TX, payload);
+        p += 1 + p[0];
+    }
+}
+
+static int mbox_canaan_tx_aggr_show(struct seq_file *s, void *unused)
+{
+    struct mbox_canaan_client_device *client_dev = s->private;
+    struct mbox_canaan_aggr *aggr;
+    int i;
+
+    seq_puts(s, "chan  enable  delay_us  max_bytes  messages  batches  dropped\n");
+    for (i = 0; i < MBOX_CHAN_NUM; i++)
+    {
+        if (!client_dev->tx_channel[i])
+            continue;
+        aggr = &client_dev->tx_channel[i]->aggr;
+        seq_printf(s, "%4d  %6d  %8u  %9u  %8u  %7u  %7u\n", i, aggr->enable,
+                    aggr->delay_us, aggr->max_bytes, aggr->messages, aggr->batches,
+                    aggr->dropped);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mbox_canaan_tx_aggr);
+
+static void mbox_canaan_aggr_init(struct mbox_canaan_client_device *client_dev)
+{
+    struct mbox_canaan_aggr *aggr;
+    int i;
+
+    for (i = 0; i < client_dev->num_chans; i++)
+    {
+        aggr = &client_dev->chans[i].aggr;
+        mutex_init(&aggr->lock);
+        mutex_init(&aggr->send_lock);
+        INIT_DELAYED_WORK(&aggr->work, mbox_canaan_aggr_work);
+        aggr->client_dev = client_dev;
+        aggr->chan_index = client_dev->chans[i].index;
+    }
+}
+
+static void mbox_canaan_aggr_exit(struct mbox_canaan_client_device *client_dev)
+{
+    int i;
+
+    for (i = 0; i < client_dev->num_chans; i++)
+    {
+        cancel_delayed_work_sync(&client_dev->chans[i].aggr.work);
+        /* the two buffers are one allocation, batch may be either half */
+        kfree(min(client_dev->chans[i].aggr.batch, client_dev->chans[i].aggr.flight));
+    }
+}
+
+/* periodic tx */
+
+static void mbox_canaan_periodic_jitter(struct mbox_canaan_periodic *per, s64 jitter)
+{
+    u64 ns = jitter < 0 ? -jitter : jitter;
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    int bucket = 0;
+
+    if (us)
+        bucket = min_t(int, ilog2(us) + 1, MBOX_JITTER_BUCKETS - 1);
+
+    per->stats.jitter_hist[bucket]++;
+    if (ns > per->stats.jitter_max_ns)
+        per->stats.jitter_max_ns = ns;
+}
+
+/*
+ * Hands the channel to another client of ours, called with tx_sem held for
+ * write. Freeing the channel also drops a request still waiting for its
+ * txdone, without the controller side API.
+ */
+static int mbox_canaan_chan_switch(struct mbox_canaan_chan *chan, struct mbox_client *client)
+{
+    struct mbox_canaan_client_device *client_dev = dev_get_drvdata(client->dev);
+    struct mbox_chan *channel;
+
+    if (chan->channel)
+        mbox_free_channel(chan->channel);
+
+    /* the position in "mboxes" */
+    channel = mbox_request_channel(client, chan - client_dev->chans);
+    if (IS_ERR(channel))
+    {
+        dev_err(client_dev->dev, "Failed to request tx channel %d\n", chan->index);
+        chan->channel = NULL;
+        return PTR_ERR(channel);
+    }
+    chan->channel = channel;
+
+    return 0;
+}
+
+static void mbox_canaan_periodic_prepare(struct mbox_client *client, void *message)
+{
+    struct mbox_canaan_client_device *client_dev = dev_get_drvdata(client->dev);
+    struct mbox_canaan_chan *chan =
+        container_of(client, struct mbox_canaan_chan, periodic.client);
+
+    memcpy_toio(chan->mmio, message, MBOX_MAX_MSG_LEN);
+    mbox_canaan_capture(client_dev, chan->index, MBOX_DIR_TX, message);
+}
+
+static void mbox_canaan_periodic_sent(struct mbox_client *client, void *message, int r)
+{
+    struct mbox_canaan_chan *chan =
+        container_of(client, struct mbox_canaan_chan, periodic.client);
+    struct mbox_canaan_periodic *per = &chan->periodic;
+    unsigned long flags;
+
+    spin_lock_irqsave(&per->lock, flags);
+    per->inflight = false;
+    spin_unlock_irqrestore(&per->lock, flags);
+    wake_up(&per->idle);
+
+    if (r)
+        dev_warn(client->dev, "Client: Message could not be sent: %d\n", r);
+}
+
+static enum hrtimer_restart mbox_canaan_periodic_tick(struct hrtimer *timer)
+{
+    struct mbox_canaan_periodic *per =
+        container_of(timer, struct mbox_canaan_periodic, timer);
+    struct mbox_canaan_chan *chan =
+        container_of(per, struct mbox_canaan_chan, periodic);
+    ktime_t now = ktime_get();
+    unsigned long flags;
+    bool send = false;
+    u64 overruns;
+    int ret;
+
+    /* softirq context, tx_done comes from the controller hardirq */
+    spin_lock_irqsave(&per->lock, flags);
+    mbox_canaan_periodic_jitter(per, ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer))));
+
+    /* only tx_done moves the ring on, a lost txdone stalls it until stop */
+    if (per->inflight)
+    {
+        per->stats.missed++;
+    }
+    else if (per->head == per->tail)
+    {
+        per->stats.underruns++;
+    }
+    else
+    {
+        /* the ring slot may be refilled while the doorbell is rung */
+        memcpy(per->msg, per->ring + (per->tail & (per->depth - 1)) * MBOX_MAX_MSG_LEN,
+                MBOX_MAX_MSG_LEN);
+        per->tail++;
+        per->inflight = true;
+        send = true;
+    }
+    spin_unlock_irqrestore(&per->lock, flags);
+
+    if (send)
+    {
+        /* the client does not block, the channel is idle so this rings the doorbell now */
+        ret = mbox_send_message(chan->channel, per->msg);
+        spin_lock_irqsave(&per->lock, flags);
+        if (ret < 0)
+        {
+            per->inflight = false;
+            per->stats.missed++;
+        }
+        else
+        {
+            per->stats.sent++;
+        }
+        spin_unlock_irqrestore(&per->lock, flags);
+    }
+
+    overruns = hrtimer_forward(timer, now, per->period);
+    if (overruns > 1)
+    {
+        spin_lock_irqsave(&per->lock, flags);
+        per->stats.missed += overruns - 1;
+        spin_unlock_irqrestore(&per->lock, flags);
+    }
+
+    return HRTIMER_RESTART;
+}
+
+static void mbox_canaan_periodic_stop(struct mbox_canaan_chan *chan)
+{
+    struct mbox_canaan_periodic *per = &chan->periodic;
+    unsigned long flags;
+    u8 *ring;
+
+    down_write(&chan->tx_sem);
+    if (!per->running)
+        goto out;
+
+    hrtimer_cancel(&per->timer);
+
+    /*
+     * Give the last message its txdone. Freeing the channel below drops a
+     * request whose txdone never came, so nothing is retired by hand.
+     */
+    if (!wait_event_timeout(per->idle, !READ_ONCE(per->inflight), msecs_to_jiffies(TIMEOUT)))
+    {
+        spin_lock_irqsave(&per->lock, flags);
+        per->stats.timeouts++;
+        spin_unlock_irqrestore(&per->lock, flags);
+    }
+
+    spin_lock_irqsave(&per->lock, flags);
+    ring = per->ring;
+    per->ring = NULL;
+    per->head = per->tail = 0;
+    per->inflight = false;
+    WRITE_ONCE(per->running, false);
+    spin_unlock_irqrestore(&per->lock, flags);
+
+    kfree(ring);
+    mbox_canaan_chan_switch(chan, &chan->client);
+out:
+    up_write(&chan->tx_sem);
+}
+
+static int mbox_canaan_periodic_start(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_periodic_config config;
+    struct mbox_canaan_periodic *per;
+    struct mbox_canaan_chan *chan;
+    unsigned long flags;
+    u8 *ring;
+    int ret;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+        return -EFAULT;
+
+    chan = mbox_canaan_tx_chan(client_dev, config.chan);
+    if (!chan || !chan->channel)
+    {
+        dev_err(client_dev->dev, "Channel cannot do Tx\n");
+        return -EINVAL;
+    }
+
+    if (!config.period_ns || !is_power_of_2(config.depth) ||
+        config.depth > MBOX_PERIODIC_MAX_DEPTH)
+        return -EINVAL;
+
+    per = &chan->periodic;
+
+    ring = kcalloc(config.depth, MBOX_MAX_MSG_LEN, GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    /* waits for blocking sends in progress before the channel changes hands */
+    down_write(&chan->tx_sem);
+    if (per->running || chan->aggr.enable)
+    {
+        up_write(&chan->tx_sem);
+        kfree(ring);
+        return -EBUSY;
+    }
+
+    /* ticks send from timer context, they must not wait for txdone */
+    ret = mbox_canaan_chan_switch(chan, &per->client);
+    if (ret)
+    {
+        mbox_canaan_chan_switch(chan, &chan->client);
+        up_write(&chan->tx_sem);
+        kfree(ring);
+        return ret;
+    }
+
+    spin_lock_irqsave(&per->lock, flags);
+    per->ring = ring;
+    per->depth = config.depth;
+    per->head = per->tail = 0;
+    per->inflight = false;
+    per->period = ns_to_ktime(config.period_ns);
+    memset(&per->stats, 0, sizeof(per->stats));
+    per->stats.chan = config.chan;
+    WRITE_ONCE(per->running, true);
+    spin_unlock_irqrestore(&per->lock, flags);
+
+    hrtimer_start(&per->timer,
+                ktime_add_ns(ktime_get(), config.start_ns ? config.start_ns : config.period_ns),
+                HRTIMER_MODE_ABS_SOFT);
+    up_write(&chan->tx_sem);
+
+    return 0;
+}
+
+static int mbox_canaan_periodic_queue(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_periodic_msg msg;
+    struct mbox_canaan_periodic *per;
+    struct mbox_canaan_chan *chan;
+    int ret = 0;
+
+    if (copy_from_user(&msg, (void __user *)arg, sizeof(msg)))
+        return -EFAULT;
+
+    chan = mbox_canaan_tx_chan(client_dev, msg.chan);
+    if (!chan)
+        return -EINVAL;
+
+    per = &chan->periodic;
+    spin_lock_irq(&per->lock);
+    if (!per->running)
+        ret = -EINVAL;
+    else if (per->head - per->tail >= per->depth)
+        ret = -EAGAIN;
+    else
+    {
+        memcpy(per->ring + (per->head & (per->depth - 1)) * MBOX_MAX_MSG_LEN,
+                msg.data, MBOX_MAX_MSG_LEN);
+        per->head++;
+    }
+    spin_unlock_irq(&per->lock);
+
+    return ret;
+}
+
+static int mbox_canaan_periodic_ioctl_stop(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_chan *chan;
+    u32 chan_index;
+
+    if (get_user(chan_index, (u32 __user *)arg))
+        return -EFAULT;
+
+    chan = mbox_canaan_tx_chan(client_dev, chan_index);
+    if (!chan)
+        return -EINVAL;
 
-#define TIMEOUT                 500 /* 50 millisecond */ 
-#define MBOX_NAME               "mailbox-client"  
-#define MBOX_CNT                1 
+    mbox_canaan_periodic_stop(chan);
 
-char *channel_name[] = {
-    "tx_chan_0",
-    "tx_chan_1",
-    "tx_chan_2",
-    "tx_chan_3",
-    "tx_chan_4",
-    "tx_chan_5",
-    "tx_chan_6",
-    "tx_chan_7",
-    "rx_chan_0",
-    "rx_chan_1",
-    "rx_chan_2",
-    "rx_chan_3",
-    "rx_chan_4",
-    "rx_chan_5",
-    "rx_chan_6",
-    "rx_chan_7",
-};
+    return 0;
+}
 
-static bool mbox_data_ready;
+static int mbox_canaan_periodic_get_stats(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_periodic_stats stats;
+    struct mbox_canaan_chan *chan;
 
-struct mbox_canaan_chan {
-    struct mbox_client  client;
-    void __iomem        *mmio;
-    struct mbox_chan    *channel;
-};
+    if (copy_from_user(&stats, (void __user *)arg, sizeof(stats)))
+        return -EFAULT;
 
-struct mbox_canaan_client_device {
-    struct device               *dev;
-    struct mbox_canaan_chan     tx_channel[SINGLE_DIR_CHAN_NUM];
-    struct mbox_canaan_chan     rx_channel[SINGLE_DIR_CHAN_NUM];
-    char                        *rx_buffer[SINGLE_DIR_CHAN_NUM];
-    char                        *message;
-    spinlock_t                  lock;
-    wait_queue_head_t           waitq;
-    struct fasync_struct        *async_queue;
-    dev_t                       devid;
-    struct cdev                 cdev;
-    struct class                *class;
-};
+    chan = mbox_canaan_tx_chan(client_dev, stats.chan);
+    if (!chan)
+        return -EINVAL;
 
+    spin_lock_irq(&chan->periodic.lock);
+    stats = chan->periodic.stats;
+    spin_unlock_irq(&chan->periodic.lock);
 
-static struct mbox_canaan_chan *to_canaan_chan(struct mbox_client *client)
+    if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int mbox_canaan_tx_periodic_show(struct seq_file *s, void *unused)
 {
-    return container_of(client, struct mbox_canaan_chan, client);
+    struct mbox_canaan_client_device *client_dev = s->private;
+    struct mbox_canaan_periodic *per;
+    int i;
+
+    seq_puts(s, "chan  running  period_ns  sent  underruns  missed  timeouts  jitter_max_ns\n");
+    for (i = 0; i < MBOX_CHAN_NUM; i++)
+    {
+        if (!client_dev->tx_channel[i])
+            continue;
+        per = &client_dev->tx_channel[i]->periodic;
+        seq_printf(s, "%4d  %7d  %9lld  %4u  %9u  %6u  %8u  %13llu\n", i, per->running,
+                    ktime_to_ns(per->period), per->stats.sent, per->stats.underruns,
+                    per->stats.missed, per->stats.timeouts, per->stats.jitter_max_ns);
+    }
+
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(mbox_canaan_tx_periodic);
 
-static int mbox_canaan_message_fasync(int fd, struct file *filp, int on)
+static void mbox_canaan_periodic_init(struct mbox_canaan_client_device *client_dev)
 {
-    struct mbox_canaan_client_device *client_dev = filp->private_data;
+    struct mbox_canaan_periodic *per;
+    int i;
 
-    return fasync_helper(fd, filp, on, &client_dev->async_queue);
+    for (i = 0; i < client_dev->num_chans; i++)
+    {
+        per = &client_dev->chans[i].periodic;
+        spin_lock_init(&per->lock);
+        init_waitqueue_head(&per->idle);
+        hrtimer_init(&per->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+        per->timer.function = mbox_canaan_periodic_tick;
+        per->client.dev = client_dev->dev;
+        per->client.tx_prepare = mbox_canaan_periodic_prepare;
+        per->client.tx_done = mbox_canaan_periodic_sent;
+        per->client.tx_block = false;
+        per->client.knows_txdone = false;
+    }
 }
 
-/* ioctl function */
-static int mbox_canaan_message_copy_send(struct file *filp, int chan_index, unsigned long arg)
+static void mbox_canaan_periodic_exit(struct mbox_canaan_client_device *client_dev)
+{
+    int i;
+
+    for (i = 0; i < client_dev->num_chans; i++)
+        mbox_canaan_periodic_stop(&client_dev->chans[i]);
+}
+
+/* control channel */
+
+/* the channel is taken out of the rx table so userspace cannot read it */
+static void mbox_canaan_ctrl_init(struct mbox_canaan_client_device *client_dev)
+{
+    struct mbox_canaan_chan *chan;
+    u32 index;
+
+    if (of_property_read_u32(client_dev->dev->of_node, "canaan,ctrl-chan", &index))
+        return;
+
+    chan = mbox_canaan_rx_chan(client_dev, index);
+    if (!chan || !chan->channel || !chan->mmio || chan->size < MBOX_MAX_MSG_LEN)
+    {
+        dev_warn(client_dev->dev, "Invalid canaan,ctrl-chan\n");
+        return;
+    }
+
+    client_dev->rx_channel[chan->index] = NULL;
+    WRITE_ONCE(client_dev->ctrl, chan);
+}
+
+/* timesync */
+
+static void mbox_canaan_timesync_work(struct work_struct *work)
 {
-    struct mbox_canaan_client_device *client_dev = filp->private_data;
-    void *data;
+    struct mbox_canaan_timesync *ts =
+        container_of(to_delayed_work(work), struct mbox_canaan_timesync, work);
+    struct mbox_canaan_timesync_msg *msg;
+    unsigned long flags;
     int ret;
 
-    // printk("[%s,%d]", __func__, __LINE__);
-    if(!client_dev->tx_channel[chan_index].channel)
+    /* t1 is stamped in tx_prepare, right before the window is written */
+    write_seqlock_irqsave(&ts->lock, flags);
+    if (ts->pending)
+        ts->lost++;
+    ts->seq++;
+    ts->pending = true;
+    msg = &ts->msg[ts->seq % MBOX_TIMESYNC_SLOTS];
+    msg->magic = MBOX_TIMESYNC_MAGIC;
+    msg->seq = ts->seq;
+    msg->t1 = 0;
+    msg->t2 = 0;
+    msg->t3 = 0;
+    write_sequnlock_irqrestore(&ts->lock, flags);
+
+    ret = mbox_send_message(ts->tx->channel, msg);
+    if (ret < 0)
     {
-        dev_err(client_dev->dev, "Channel cannot do Tx\n");
-        return -EINVAL;
+        write_seqlock_irqsave(&ts->lock, flags);
+        ts->pending = false;
+        ts->lost++;
+        write_sequnlock_irqrestore(&ts->lock, flags);
     }
 
-    client_dev->message = kzalloc(MBOX_MAX_MSG_LEN, GFP_KERNEL);
-    if (!client_dev->message)
-        return -ENOMEM;
+    schedule_delayed_work(&ts->work, msecs_to_jiffies(MBOX_TIMESYNC_PERIOD_MS));
+}
 
-    ret = copy_from_user(client_dev->message, (char *)arg, MBOX_MAX_MSG_LEN);
-    if (ret) 
+static void mbox_canaan_timesync_commit(struct mbox_canaan_timesync *ts)
+{
+    s64 dcpu, diff, rate;
+
+    ts->window = 0;
+    if (ts->valid)
     {
-        ret = -EFAULT;
-        goto out;
+        dcpu = ts->best_cpu - ts->ref_cpu;
+        diff = ts->best_dsp - ts->ref_dsp - dcpu;
+        /* both bounds also keep diff * NSEC_PER_SEC from overflowing */
+        if (dcpu <= 0 || dcpu > (s64)MBOX_TIMESYNC_MAX_GAP_MS * NSEC_PER_MSEC ||
+            abs(diff) > div_s64(dcpu * MBOX_TIMESYNC_MAX_PPM, USEC_PER_SEC))
+        {
+            ts->valid = false;
+            ts->drift_ppb = 0;
+            ts->resyncs++;
+            return;
+        }
+        rate = div64_s64(diff * NSEC_PER_SEC, dcpu);
+        ts->drift_ppb = ts->drift_ppb ? (ts->drift_ppb * 3 + rate) / 4 : rate;
     }
 
-    data = client_dev->message;
-    // print_hex_dump(KERN_INFO, "Client: send [MMIO]: ", DUMP_PREFIX_ADDRESS, 16, 1,
-	// 				data, MBOX_MAX_MSG_LEN, true);
+    ts->ref_cpu = ts->best_cpu;
+    ts->ref_dsp = ts->best_dsp;
+    ts->min_delay = ts->best_delay;
+    ts->valid = true;
+}
 
-    ret = mbox_send_message(client_dev->tx_channel[chan_index].channel, data);
-    if (ret < 0)
-        dev_err(client_dev->dev, "Failed to send message via mailbox\n");
+/* called from tx_prepare of the timesync tx channel */
+static void mbox_canaan_timesync_stamp(struct mbox_canaan_timesync *ts,
+                                        struct mbox_canaan_timesync_msg *msg)
+{
+    unsigned long flags;
 
-out:
-    kfree(client_dev->message);
+    write_seqlock_irqsave(&ts->lock, flags);
+    msg->t1 = ktime_get_ns();
+    write_sequnlock_irqrestore(&ts->lock, flags);
+}
 
-    return ret < 0 ? ret : 0;
+/* called from rx_callback of the timesync rx channel, t4 taken on entry */
+static void mbox_canaan_timesync_reply(struct mbox_canaan_client_device *client_dev, u64 t4)
+{
+    struct mbox_canaan_timesync *ts = &client_dev->timesync;
+    struct mbox_canaan_timesync_msg msg;
+    unsigned long flags;
+    s64 delay, offset, cpu;
+
+    memcpy_fromio(&msg, ts->rx->mmio, sizeof(msg));
+    if (msg.magic != MBOX_TIMESYNC_REPLY_MAGIC)
+        return;
+
+    write_seqlock_irqsave(&ts->lock, flags);
+    if (!ts->pending || msg.seq != ts->seq)
+        goto out;
+    ts->pending = false;
+
+    delay = (s64)(t4 - msg.t1) - (s64)(msg.t3 - msg.t2);
+    if (delay < 0)
+    {
+        ts->lost++;
+        goto out;
+    }
+    offset = ((s64)(msg.t2 - msg.t1) + (s64)(msg.t3 - t4)) / 2;
+    cpu = msg.t1 + (t4 - msg.t1) / 2;
+
+    ts->samples++;
+    ts->last_delay = delay;
+    if (!ts->window || delay < ts->best_delay)
+    {
+        ts->best_delay = delay;
+        ts->best_cpu = cpu;
+        ts->best_dsp = cpu + offset;
+    }
+    if (++ts->window == MBOX_TIMESYNC_WINDOW)
+        mbox_canaan_timesync_commit(ts);
+out:
+    write_sequnlock_irqrestore(&ts->lock, flags);
 }
 
-static int mbox_canaan_message_copy_received(struct file *filp, int chan_index, unsigned long arg)
+/* DSP timestamp to CLOCK_MONOTONIC, -EAGAIN until the first window is done */
+static int mbox_canaan_timesync_to_ktime(struct mbox_canaan_client_device *client_dev,
+                                        u64 dsp_ns, ktime_t *cpu)
 {
-    struct mbox_canaan_client_device *client_dev = filp->private_data;
+    struct mbox_canaan_timesync *ts = &client_dev->timesync;
+    unsigned int seq;
+    s64 delta, secs;
+    s32 rem;
     int ret;
 
-    // printk("[%s,%d]", __func__, __LINE__);
-    if(!client_dev->rx_channel[chan_index].channel)
+    do
     {
-        dev_err(client_dev->dev, "Channel cannot do Rx\n");
-        return -EINVAL;
-    }
+        seq = read_seqbegin(&ts->lock);
+        ret = ts->valid ? 0 : -EAGAIN;
+        /*
+         * first order is plenty for ppm drifts. drift_ppb is bounded by
+         * MBOX_TIMESYNC_MAX_PPM, split delta at whole seconds so neither
+         * product can overflow for any dsp_ns
+         */
+        delta = (s64)(dsp_ns - ts->ref_dsp);
+        secs = div_s64_rem(delta, NSEC_PER_SEC, &rem);
+        delta -= secs * ts->drift_ppb + div_s64((s64)rem * ts->drift_ppb, NSEC_PER_SEC);
+        *cpu = ns_to_ktime(ts->ref_cpu + delta);
+    } while (read_seqretry(&ts->lock, seq));
+
+    return ret;
+}
 
-    ret = copy_to_user((char *)arg, client_dev->rx_buffer[chan_index], MBOX_MAX_MSG_LEN);
-    mbox_data_ready = false;
-    if (ret) 
+static int mbox_canaan_timesync_convert(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_client_device *client_dev = to_client_dev(filp);
+    struct mbox_canaan_timesync_convert conv;
+    ktime_t cpu;
+    int ret;
+
+    if (!client_dev->timesync.tx)
+        return -ENODEV;
+
+    if (copy_from_user(&conv, (void __user *)arg, sizeof(conv)))
         return -EFAULT;
-    
+
+    ret = mbox_canaan_timesync_to_ktime(client_dev, conv.dsp_ns, &cpu);
+    if (ret)
+        return ret;
+    conv.cpu_ns = ktime_to_ns(cpu);
+
+    if (copy_to_user((void __user *)arg, &conv, sizeof(conv)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int mbox_canaan_timesync_show(struct seq_file *s, void *unused)
+{
+    struct mbox_canaan_client_device *client_dev = s->private;
+    struct mbox_canaan_timesync *ts = &client_dev->timesync;
+    s64 offset, drift, min_delay, last_delay;
+    u32 samples, lost, resyncs;
+    unsigned int seq;
+    bool valid;
+
+    if (!ts->tx)
+        return 0;
+
+    do
+    {
+        seq = read_seqbegin(&ts->lock);
+        valid = ts->valid;
+        offset = ts->ref_dsp - ts->ref_cpu;
+        drift = ts->drift_ppb;
+        min_delay = ts->min_delay;
+        last_delay = ts->last_delay;
+        samples = ts->samples;
+        lost = ts->lost;
+        resyncs = ts->resyncs;
+    } while (read_seqretry(&ts->lock, seq));
+
+    seq_printf(s, "tx_chan %d rx_chan %d valid %d\n", ts->tx->index, ts->rx->index, valid);
+    seq_printf(s, "offset_ns %lld drift_ppb %lld\n", offset, drift);
+    seq_printf(s, "min_delay_ns %lld last_delay_ns %lld\n", min_delay, last_delay);
+    seq_printf(s, "samples %u lost %u resyncs %u\n", samples, lost, resyncs);
+
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(mbox_canaan_timesync);
+
+/* the pair is taken out of the channel tables so userspace cannot use it */
+static void mbox_canaan_timesync_init(struct mbox_canaan_client_device *client_dev)
+{
+    struct mbox_canaan_timesync *ts = &client_dev->timesync;
+    struct mbox_canaan_chan *tx, *rx;
+    u32 pair[2];
+
+    seqlock_init(&ts->lock);
+    INIT_DELAYED_WORK(&ts->work, mbox_canaan_timesync_work);
+
+    if (of_property_read_u32_array(client_dev->dev->of_node, "canaan,timesync-chan",
+                                    pair, 2))
+        return;
+
+    tx = mbox_canaan_tx_chan(client_dev, pair[0]);
+    rx = mbox_canaan_rx_chan(client_dev, pair[1]);
+    if (!tx || !tx->channel || !tx->mmio || !rx || !rx->channel || !rx->mmio ||
+        rx->size < sizeof(struct mbox_canaan_timesync_msg))
+    {
+        dev_warn(client_dev->dev, "Invalid canaan,timesync-chan\n");
+        return;
+    }
+
+    client_dev->tx_channel[tx->index] = NULL;
+    client_dev->rx_channel[rx->index] = NULL;
+    ts->rx = rx;
+    smp_wmb();
+    ts->tx = tx;
+
+    schedule_delayed_work(&ts->work, 0);
+}
+
+static void mbox_canaan_timesync_exit(struct mbox_canaan_client_device *client_dev)
+{
+    if (client_dev->timesync.tx)
+        cancel_delayed_work_sync(&client_dev->timesync.work);
+}
+
+static void mbox_canaan_debugfs_init(struct mbox_canaan_client_device *client_dev)
+{
+    char name[16];
+    int i;
+
+    client_dev->debugfs = debugfs_create_dir(MBOX_NAME, NULL);
+    if (IS_ERR_OR_NULL(client_dev->debugfs))
+    {
+        client_dev->debugfs = NULL;
+        return;
+    }
+
+    spin_lock_init(&client_dev->capture_lock);
+    client_dev->capture = relay_open("capture", client_dev->debugfs,
+                                    MBOX_CAPTURE_SUBBUF_SIZE, MBOX_CAPTURE_SUBBUF_NUM,
+                                    &mbox_canaan_capture_callbacks, client_dev);
+    if (!client_dev->capture)
+        dev_warn(client_dev->dev, "Failed to create capture buffer\n");
+
+    debugfs_create_bool("capture_enable", 0600, client_dev->debugfs,
+                        &client_dev->capture_enable);
+    debugfs_create_u32("capture_dropped", 0400, client_dev->debugfs,
+                        &client_dev->capture_dropped);
+    debugfs_create_u32("dmabuf_unknown", 0400, client_dev->debugfs,
+                        &client_dev->dmabuf_unknown);
+    debugfs_create_u32("ctrl_unknown", 0400, client_dev->debugfs,
+                        &client_dev->ctrl_unknown);
+
+    for (i = 0; i < MBOX_CHAN_NUM; i++)
+    {
+        if (!client_dev->rx_channel[i])
+            continue;
+        snprintf(name, sizeof(name), "rx_verdict_%d", i);
+        debugfs_create_x32(name, 0600, client_dev->debugfs, &client_dev->rx_channel[i]->verdict);
+    }
+    debugfs_create_file("rx_filter", 0400, client_dev->debugfs, client_dev,
+                        &mbox_canaan_rx_filter_fops);
+    debugfs_create_file("tx_aggr", 0400, client_dev->debugfs, client_dev,
+                        &mbox_canaan_tx_aggr_fops);
+    debugfs_create_file("tx_periodic", 0400, client_dev->debugfs, client_dev,
+                        &mbox_canaan_tx_periodic_fops);
+    debugfs_create_file("heap", 0400, client_dev->debugfs, client_dev,
+                        &mbox_canaan_heap_fops);
+    debugfs_create_file("timesync", 0400, client_dev->debugfs, client_dev,
+                        &mbox_canaan_timesync_fops);
+}
+
+static void mbox_canaan_debugfs_exit(struct mbox_canaan_client_device *client_dev)
+{
+    client_dev->capture_enable = false;
+    if (client_dev->capture)
+        relay_close(client_dev->capture);
+    debugfs_remove_recursive(client_dev->debugfs);
+}
 
 /* client callback */
 
+static void mbox_canaan_ctrl_message(struct mbox_canaan_client_device *client_dev,
+                                    struct mbox_canaan_chan *chan)
+{
+    u32 data[MBOX_MAX_MSG_LEN / sizeof(u32)];
+
+    memcpy_fromio(data, chan->mmio, MBOX_MAX_MSG_LEN);
+    mbox_canaan_capture(client_dev, chan->index, MBOX_DIR_RX, data);
+
+    if (mbox_canaan_dmabuf_reply(client_dev, data))
+        return;
+
+    if (mbox_canaan_heap_reply(client_dev, data))
+        return;
+
+    client_dev->ctrl_unknown++;
+}
+
 static void mbox_canaan_receive_message(struct mbox_client *client, void *message)
 {
     struct mbox_canaan_client_device *client_dev = dev_get_drvdata(client->dev);
     struct mbox_canaan_chan *chan = to_canaan_chan(client);
+    struct mbox_canaan_chan *target;
+    struct mbox_canaan_rx_ctx ctx;
+    u32 data[MBOX_MAX_MSG_LEN / sizeof(u32)];
     unsigned long flags;
-    int chan_index = (int)chan->channel->con_priv;
-    chan_index -= SINGLE_DIR_CHAN_NUM;
+    int chan_index = chan->index;
 
     // printk("[%s,%d], chan_index:%d", __func__, __LINE__, chan_index);
 
-    spin_lock_irqsave(&client_dev->lock, flags);
-    memcpy_fromio(client_dev->rx_buffer[chan_index], client_dev->rx_channel[chan_index].mmio, MBOX_MAX_MSG_LEN);
+    if (chan == client_dev->timesync.rx)
+    {
+        mbox_canaan_timesync_reply(client_dev, ktime_get_ns());
+        return;
+    }
+
+    if (chan == client_dev->ctrl)
+    {
+        mbox_canaan_ctrl_message(client_dev, chan);
+        return;
+    }
+
+    /* the DSP only interrupts a snapshot channel on a significant change */
+    if (READ_ONCE(chan->snapshot))
+    {
+        spin_lock_irqsave(&chan->lock, flags);
+        chan->snapshot_notify++;
+        chan->data_ready = true;
+        spin_unlock_irqrestore(&chan->lock, flags);
+        goto wake;
+    }
+
+    /* the filter sees a stable copy, the DSP may already write the next one */
+    memcpy_fromio(data, chan->mmio, MBOX_MAX_MSG_LEN);
+    mbox_canaan_capture(client_dev, chan_index, MBOX_DIR_RX, data);
+
+    ctx.chan = chan_index;
+    ctx.payload = (const u8 *)data;
+    mbox_canaan_rx_filter(client_dev, &ctx);
+    if (ctx.action == MBOX_RX_ACTION_REDIRECT)
+    {
+        /* a snapshot channel has no rx buffer of its own to deliver into */
+        target = mbox_canaan_rx_chan(client_dev, ctx.target);
+        if (!target || target == chan || READ_ONCE(target->snapshot))
+        {
+            chan->dropped++;
+            return;
+        }
+        spin_lock_irqsave(&target->lock, flags);
+        if (!kfifo_put(&target->redirect, *(struct mbox_canaan_rx_msg *)data))
+        {
+            target->redirect_overflow++;
+            spin_unlock_irqrestore(&target->lock, flags);
+            chan->dropped++;
+            return;
+        }
+        target->delivered++;
+        spin_unlock_irqrestore(&target->lock, flags);
+        chan->redirected++;
+        chan = target;
+        goto wake;
+    }
+    if (ctx.action != MBOX_RX_ACTION_PASS)
+    {
+        /* dropped status chatter never wakes userspace */
+        chan->dropped++;
+        return;
+    }
+
+    spin_lock_irqsave(&chan->lock, flags);
+    chan->delivered++;
+    memcpy(chan->rx_buffer, data, MBOX_MAX_MSG_LEN);
     // print_hex_dump(KERN_INFO, "Client: Received [MMIO]: ", DUMP_PREFIX_ADDRESS, 16, 1,
-	// 				client_dev->rx_buffer[chan_index], MBOX_MAX_MSG_LEN, true);
+	// 				chan->rx_buffer, MBOX_MAX_MSG_LEN, true);
     // print_hex_dump(KERN_INFO, "Client: Received [MMIO]: ", DUMP_PREFIX_ADDRESS, 16, 1,
-	// 				client_dev->rx_channel[chan_index].mmio, MBOX_MAX_MSG_LEN, true);
-    mbox_data_ready = true;
-    spin_unlock_irqrestore(&client_dev->lock, flags);
+	// 				chan->mmio, MBOX_MAX_MSG_LEN, true);
+    chan->data_ready = true;
+    spin_unlock_irqrestore(&chan->lock, flags);
 
-    wake_up_interruptible(&client_dev->waitq);
+wake:
+    wake_up_interruptible(&chan->waitq);
     kill_fasync(&client_dev->async_queue, SIGIO, POLL_IN);
 }
 
@@ -181,14 +2629,21 @@ static void mbox_canaan_prepare_message(struct mbox_client *client, void *messag
 {
     struct mbox_canaan_client_device *client_dev = dev_get_drvdata(client->dev);
     struct mbox_canaan_chan *chan = to_canaan_chan(client);
-    int chan_index = (int)chan->channel->con_priv;
+    int chan_index = chan->index;
 
     // printk("[%s,%d], chan_index:%d", __func__, __LINE__, chan_index);
 
-    memcpy_toio(client_dev->tx_channel[chan_index].mmio, client_dev->message, MBOX_MAX_MSG_LEN);
+    if (chan == client_dev->timesync.tx)
+        mbox_canaan_timesync_stamp(&client_dev->timesync, message);
+
+    memcpy_toio(chan->mmio, message, mbox_canaan_tx_len(chan, message));
+    if (message == chan->aggr.flight)
+        mbox_canaan_capture_batch(client_dev, chan_index, message);
+    else
+        mbox_canaan_capture(client_dev, chan_index, MBOX_DIR_TX, message);
 
     // print_hex_dump(KERN_INFO, "Client: Send [MMIO]: ", DUMP_PREFIX_ADDRESS, 16, 1,
-	// 				client_dev->tx_channel[chan_index].mmio, MBOX_MAX_MSG_LEN, true);
+	// 				chan->mmio, MBOX_MAX_MSG_LEN, true);
 }
 
 static void mbox_canaan_message_sent(struct mbox_client *client,
@@ -203,7 +2658,7 @@ static void mbox_canaan_message_sent(struct mbox_client *client,
 
 }
 
-static void mbox_canaan_request_channel(struct platform_device *pdev, 
+static int mbox_canaan_request_channel(struct platform_device *pdev, 
                                     struct mbox_canaan_chan *canaan_chan, 
                                     int chan_index)
 {
@@ -215,41 +2670,84 @@ static void mbox_canaan_request_channel(struct platform_device *pdev,
     canaan_chan->client.knows_txdone    = false;
     canaan_chan->client.tx_tout         = TIMEOUT;
 
-    canaan_chan->channel = mbox_request_channel_byname(&canaan_chan->client, channel_name[chan_index]);
+    /* chan_index is the position in "mboxes" */
+    canaan_chan->channel = mbox_request_channel(&canaan_chan->client, chan_index);
     if (IS_ERR(canaan_chan->channel))
-        dev_warn(&pdev->dev, "Failed to request %s channel\n", channel_name[chan_index]);
+    {
+        int ret = PTR_ERR(canaan_chan->channel);
+
+        dev_warn(&pdev->dev, "Failed to request %s channel %d\n",
+                canaan_chan->dir == MBOX_DIR_TX ? "tx" : "rx", canaan_chan->index);
+        canaan_chan->channel = NULL;
+        return ret;
+    }
+
+    return 0;
 }
 
 /* file_operations */
 
 static int mbox_canaan_client_open(struct inode *inode, struct file *filp)
 {
-    struct mbox_canaan_client_device *client_dev;
+    struct mbox_canaan_file *file;
     // printk("[%s,%d]", __func__, __LINE__);
 
-    client_dev = container_of(inode->i_cdev, struct mbox_canaan_client_device, cdev);
-    filp->private_data = client_dev;
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+
+    file->client_dev = container_of(inode->i_cdev, struct mbox_canaan_client_device, cdev);
+    file->rx_mask = GENMASK(MBOX_CHAN_NUM - 1, 0);
+    filp->private_data = file;
 
     return 0;
 }
 
 static int mbox_canaan_client_release(struct inode *inode, struct file *filp)
 {
+    struct mbox_canaan_file *file = filp->private_data;
+
+    /* unread data belongs to the channel, other openers may still want it */
     mbox_canaan_message_fasync(-1, filp, 0);
-    mbox_data_ready = false;
+    mbox_canaan_heap_release(&file->client_dev->heap, file);
+    kfree(file);
+
     return 0;
 }
 
-static bool mbox_canaan_data_ready(struct mbox_canaan_client_device *client_dev)
+/*
+ * any selected rx channel with unread data or queued redirects, checked
+ * without taking the channel locks
+ */
+static bool mbox_canaan_data_ready(struct mbox_canaan_client_device *client_dev, u32 rx_mask)
 {
-    bool data_ready;
-    unsigned long flags;
+    int i;
+
+    for (i = 0; i < MBOX_CHAN_NUM; i++)
+    {
+        if ((rx_mask & BIT(i)) && client_dev->rx_channel[i] &&
+            (READ_ONCE(client_dev->rx_channel[i]->data_ready) ||
+             !kfifo_is_empty(&client_dev->rx_channel[i]->redirect)))
+            return true;
+    }
+
+    return false;
+}
+
+static int mbox_canaan_poll_mask(struct file *filp, unsigned long arg)
+{
+    struct mbox_canaan_file *file = filp->private_data;
+    u32 rx_mask;
+
+    if (get_user(rx_mask, (u32 __user *)arg))
+        return -EFAULT;
+
+    if (rx_mask & ~GENMASK(MBOX_CHAN_NUM - 1, 0))
+        return -EINVAL;
 
-	spin_lock_irqsave(&client_dev->lock, flags);
-	data_ready = mbox_data_ready;
-	spin_unlock_irqrestore(&client_dev->lock, flags);
+    WRITE_ONCE(file->rx_mask, rx_mask);
 
-	return data_ready;
+    return 0;
 }
 
 static long mbox_canaan_client_ioctl(struct file *filp, unsigned int cmd, 
@@ -258,55 +2756,75 @@ static long mbox_canaan_client_ioctl(struct file *filp, unsigned int cmd,
     switch (cmd)
     {
         case MBOX_CHAN_0_TX :
-            mbox_canaan_message_copy_send(filp, 0, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 0, arg);
         case MBOX_CHAN_1_TX :
-            mbox_canaan_message_copy_send(filp, 1, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 1, arg);
         case MBOX_CHAN_2_TX :
-            mbox_canaan_message_copy_send(filp, 2, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 2, arg);
         case MBOX_CHAN_3_TX :
-            mbox_canaan_message_copy_send(filp, 3, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 3, arg);
         case MBOX_CHAN_4_TX :
-            mbox_canaan_message_copy_send(filp, 4, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 4, arg);
         case MBOX_CHAN_5_TX :
-            mbox_canaan_message_copy_send(filp, 5, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 5, arg);
         case MBOX_CHAN_6_TX :
-            mbox_canaan_message_copy_send(filp, 6, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 6, arg);
         case MBOX_CHAN_7_TX :
-            mbox_canaan_message_copy_send(filp, 7, arg);
-            break;
+            return mbox_canaan_message_copy_send(filp, 7, arg);
         case MBOX_CHAN_0_RX :
-            if (mbox_canaan_message_copy_received(filp, 0, arg) < 0)
-                return -EFAULT;
-            break;
+            return mbox_canaan_message_copy_received(filp, 0, arg);
         case MBOX_CHAN_1_RX :
-            mbox_canaan_message_copy_received(filp, 1, arg);
-            break;
+            return mbox_canaan_message_copy_received(filp, 1, arg);
         case MBOX_CHAN_2_RX :
-            mbox_canaan_message_copy_received(filp, 2, arg);
-            break;
+            return mbox_canaan_message_copy_received(filp, 2, arg);
         case MBOX_CHAN_3_RX :
-            mbox_canaan_message_copy_received(filp, 3, arg);
-            break;
+            return mbox_canaan_message_copy_received(filp, 3, arg);
         case MBOX_CHAN_4_RX :
-            mbox_canaan_message_copy_received(filp, 4, arg);
-            break;
+            return mbox_canaan_message_copy_received(filp, 4, arg);
         case MBOX_CHAN_5_RX :
-            mbox_canaan_message_copy_received(filp, 5, arg);
-            break;
+            return mbox_canaan_message_copy_received(filp, 5, arg);
         case MBOX_CHAN_6_RX :
-            mbox_canaan_message_copy_received(filp, 6, arg);
-            break;
+            return mbox_canaan_message_copy_received(filp, 6, arg);
         case MBOX_CHAN_7_RX :
-            mbox_canaan_message_copy_received(filp, 7, arg);
-            break;
+            return mbox_canaan_message_copy_received(filp, 7, arg);
+        case MBOX_DMABUF_TX :
+            return mbox_canaan_dmabuf_send(filp, arg);
+        case MBOX_DMABUF_WAIT :
+            return mbox_canaan_dmabuf_wait(filp, arg);
+        case MBOX_TX_AGGR_CONFIG :
+            return mbox_canaan_aggr_config(filp, arg);
+        case MBOX_TX_AGGR_SEND :
+            return mbox_canaan_aggr_send(filp, arg);
+        case MBOX_SNAPSHOT_CONFIG :
+            return mbox_canaan_snapshot_config(filp, arg);
+        case MBOX_PERIODIC_START :
+            return mbox_canaan_periodic_start(filp, arg);
+        case MBOX_PERIODIC_QUEUE :
+            return mbox_canaan_periodic_queue(filp, arg);
+        case MBOX_PERIODIC_STOP :
+            return mbox_canaan_periodic_ioctl_stop(filp, arg);
+        case MBOX_PERIODIC_STATS :
+            return mbox_canaan_periodic_get_stats(filp, arg);
+        case MBOX_HEAP_ALLOC :
+            return mbox_canaan_heap_ioctl_alloc(filp, arg);
+        case MBOX_HEAP_FREE :
+            return mbox_canaan_heap_ioctl_give(filp, arg, false);
+        case MBOX_HEAP_HANDOFF :
+            return mbox_canaan_heap_ioctl_give(filp, arg, true);
+        case MBOX_TIMESYNC_CONVERT :
+            return mbox_canaan_timesync_convert(filp, arg);
+        case MBOX_POLL_MASK :
+            return mbox_canaan_poll_mask(filp, arg);
         default :
+            /* channels above 7 have no named command */
+            if (_IOC_TYPE(cmd) == 'm' && _IOC_NR(cmd) < MBOX_CHAN_NUM &&
+                _IOC_SIZE(cmd) == sizeof(unsigned long))
+            {
+                if (cmd == MBOX_CHAN_TX(_IOC_NR(cmd)))
+                    return mbox_canaan_message_copy_send(filp, _IOC_NR(cmd), arg);
+                if (cmd == MBOX_CHAN_RX(_IOC_NR(cmd)))
+                    return mbox_canaan_message_copy_received(filp, _IOC_NR(cmd), arg);
+            }
             return -EINVAL;        
     }
 
@@ -316,11 +2834,18 @@ static long mbox_canaan_client_ioctl(struct file *filp, unsigned int cmd,
 static __poll_t
 mbox_canaan_client_poll(struct file *filp, struct poll_table_struct *wait)
 {
-    struct mbox_canaan_client_device *client_dev = filp->private_data;
+    struct mbox_canaan_file *file = filp->private_data;
+    struct mbox_canaan_client_device *client_dev = file->client_dev;
+    u32 rx_mask = READ_ONCE(file->rx_mask);
+    int i;
 
-    poll_wait(filp, &client_dev->waitq, wait);
+    for (i = 0; i < MBOX_CHAN_NUM; i++)
+    {
+        if ((rx_mask & BIT(i)) && client_dev->rx_channel[i])
+            poll_wait(filp, &client_dev->rx_channel[i]->waitq, wait);
+    }
 
-    if (mbox_canaan_data_ready(client_dev))
+    if (mbox_canaan_data_ready(client_dev, rx_mask))
         return EPOLLIN | EPOLLRDNORM;
 
     return 0;
@@ -333,6 +2858,7 @@ static struct file_operations canaan_client_fops = {
     .unlocked_ioctl = mbox_canaan_client_ioctl,
     .fasync         = mbox_canaan_message_fasync,
     .poll           = mbox_canaan_client_poll,
+    .mmap           = mbox_canaan_client_mmap,
 };
 
 static int create_module_class(struct mbox_canaan_client_device *client_dev)
@@ -362,66 +2888,136 @@ static void destroy_module_class(struct mbox_canaan_client_device *client_dev)
 
 
 
+static void mbox_canaan_free_channels(struct mbox_canaan_client_device *client_dev)
+{
+    int i;
+
+    for (i = 0; i < client_dev->num_chans; i++)
+    {
+        if (client_dev->chans[i].channel)
+            mbox_free_channel(client_dev->chans[i].channel);
+        client_dev->chans[i].channel = NULL;
+    }
+}
+
 static int mbox_canaan_client_probe(struct platform_device *pdev)
 {
     struct mbox_canaan_client_device *client_dev;
+    struct device_node *np = pdev->dev.of_node;
+    struct mbox_canaan_chan *chans, *chan;
+    struct mbox_canaan_chan **table;
     struct resource *res;
     resource_size_t size;
+    const char *name;
+    unsigned int n;
+    int count;
+    int ret;
     int i;
 
     // printk("[%s,%d]", __func__, __LINE__);
 
+    count = of_property_count_strings(np, "mbox-names");
+    if (count <= 0 || count > MBOX_CHAN_NUM)
+    {
+        dev_err(&pdev->dev, "Invalid mbox-names\n");
+        return -EINVAL;
+    }
+
     client_dev = devm_kzalloc(&pdev->dev, sizeof(*client_dev), GFP_KERNEL);
     if (!client_dev)
         return -ENOMEM;
 
-    for (i = 0; i < SINGLE_DIR_CHAN_NUM; i++)
+    /* all channels in one block, aligned by hand since kmalloc may not be */
+    chans = devm_kzalloc(&pdev->dev, sizeof(*chans) * count + SMP_CACHE_BYTES,
+                        GFP_KERNEL);
+    if (!chans)
+        return -ENOMEM;
+    chans = PTR_ALIGN(chans, SMP_CACHE_BYTES);
+    client_dev->chans = chans;
+    client_dev->num_chans = count;
+
+    for (i = 0; i < count; i++)
     {
-        res = platform_get_resource(pdev, IORESOURCE_MEM, i);
-        size = resource_size(res);
-        client_dev->tx_channel[i].mmio = devm_ioremap_resource(&pdev->dev, res);
-        if (PTR_ERR(client_dev->tx_channel[i].mmio) == -EBUSY)
-            client_dev->tx_channel[i].mmio = devm_ioremap(&pdev->dev, res->start, size);
-        else if (IS_ERR(client_dev->tx_channel[i].mmio))
-            client_dev->tx_channel[i].mmio = NULL;
+        chan = &chans[i];
+        spin_lock_init(&chan->lock);
+        INIT_KFIFO(chan->redirect);
+        init_waitqueue_head(&chan->waitq);
+        init_rwsem(&chan->tx_sem);
+        mutex_init(&chan->tx_lock);
+
+        /* the name gives direction and number, the position the reg entry */
+        of_property_read_string_index(np, "mbox-names", i, &name);
+        if (sscanf(name, "tx_chan_%u", &n) == 1)
+        {
+            chan->dir = MBOX_DIR_TX;
+            table = client_dev->tx_channel;
+        }
+        else if (sscanf(name, "rx_chan_%u", &n) == 1)
+        {
+            chan->dir = MBOX_DIR_RX;
+            table = client_dev->rx_channel;
+        }
+        else
+        {
+            dev_warn(&pdev->dev, "Unknown channel name %s\n", name);
+            continue;
+        }
 
-        res = platform_get_resource(pdev, IORESOURCE_MEM, i + SINGLE_DIR_CHAN_NUM);
-        size = resource_size(res);
-        client_dev->rx_channel[i].mmio = devm_ioremap_resource(&pdev->dev, res);
-        if (PTR_ERR(client_dev->rx_channel[i].mmio) == -EBUSY)
-            client_dev->rx_channel[i].mmio = devm_ioremap(&pdev->dev, res->start, size);
-        else if (IS_ERR(client_dev->rx_channel[i].mmio))
-            client_dev->rx_channel[i].mmio = NULL;
-    }
+        if (n >= MBOX_CHAN_NUM || table[n])
+        {
+            dev_warn(&pdev->dev, "Invalid or duplicate channel %s\n", name);
+            continue;
+        }
+        chan->index = n;
+        table[n] = chan;
 
-    for (i = 0; i < SINGLE_DIR_CHAN_NUM; i++)
-    {
-        mbox_canaan_request_channel(pdev, &client_dev->tx_channel[i], i);
-        mbox_canaan_request_channel(pdev, &client_dev->rx_channel[i], i + SINGLE_DIR_CHAN_NUM);
-    
-        if(!client_dev->tx_channel[i].channel && !client_dev->rx_channel[i].channel)
-            return -EPROBE_DEFER;
+        res = platform_get_resource(pdev, IORESOURCE_MEM, i);
+        if (!res)
+            continue;
+        size = resource_size(res);
+        chan->mmio = devm_ioremap_resource(&pdev->dev, res);
+        if (PTR_ERR(chan->mmio) == -EBUSY)
+            chan->mmio = devm_ioremap(&pdev->dev, res->start, size);
+        else if (IS_ERR(chan->mmio))
+            chan->mmio = NULL;
+        chan->phys = res->start;
+        chan->size = size;
     }
 
     client_dev->dev = &pdev->dev;
     platform_set_drvdata(pdev, client_dev);
 
-    spin_lock_init(&client_dev->lock);
+    ret = mbox_canaan_heap_init(pdev, client_dev);
+    if (ret)
+        return ret;
 
-    for (i = 0; i < SINGLE_DIR_CHAN_NUM; i++)
+    INIT_LIST_HEAD(&client_dev->dmabuf_list);
+    INIT_LIST_HEAD(&client_dev->dmabuf_done);
+    spin_lock_init(&client_dev->dmabuf_lock);
+    INIT_WORK(&client_dev->dmabuf_work, mbox_canaan_dmabuf_work);
+    init_waitqueue_head(&client_dev->dmabuf_waitq);
+    mbox_canaan_aggr_init(client_dev);
+    mbox_canaan_periodic_init(client_dev);
+
+    for (i = 0; i < count; i++)
     {
-        if (client_dev->rx_channel)
+        chan = &chans[i];
+        if (client_dev->tx_channel[chan->index] != chan &&
+            client_dev->rx_channel[chan->index] != chan)
+            continue;
+
+        ret = mbox_canaan_request_channel(pdev, chan, i);
+        if (ret == -EPROBE_DEFER)
         {
-            client_dev->rx_buffer[i] = devm_kzalloc(&pdev->dev,
-                                        MBOX_MAX_MSG_LEN, GFP_KERNEL);
-            if (!client_dev->rx_buffer)
-                return -ENOMEM;
+            mbox_canaan_free_channels(client_dev);
+            return ret;
         }
     }
 
-    init_waitqueue_head(&client_dev->waitq);
-
+    mbox_canaan_ctrl_init(client_dev);
+    mbox_canaan_timesync_init(client_dev);
     create_module_class(client_dev);
+    mbox_canaan_debugfs_init(client_dev);
 
     dev_info(&pdev->dev, "Successfully registered\n");
 
@@ -430,17 +3026,15 @@ static int mbox_canaan_client_probe(struct platform_device *pdev)
 
 static int mbox_canaan_client_remove(struct platform_device *pdev)
 {
-    int i;
     struct mbox_canaan_client_device *client_dev = platform_get_drvdata(pdev);
 
-    for (i = 0; i < SINGLE_DIR_CHAN_NUM; i++)
-    {
-        if (client_dev->tx_channel[i].channel)
-            mbox_free_channel(client_dev->tx_channel[i].channel);
-        if (client_dev->rx_channel[i].channel)
-            mbox_free_channel(client_dev->rx_channel[i].channel);
-    }
+    mbox_canaan_timesync_exit(client_dev);
+    mbox_canaan_periodic_exit(client_dev);
+    mbox_canaan_aggr_exit(client_dev);
+    mbox_canaan_free_channels(client_dev);
+    mbox_canaan_dmabuf_release_all(client_dev);
 
+    mbox_canaan_debugfs_exit(client_dev);
     destroy_module_class(client_dev);
 
     // printk("[%s,%d]", __func__, __LINE__);
@@ -462,23 +3056,31 @@ static struct platform_driver mbox_canaan_client_driver = {
     .probe = mbox_canaan_client_probe,
     .remove = mbox_canaan_client_remove,
 };
-module_platform_driver(mbox_canaan_client_driver);
+static int __init mbox_canaan_client_init(void)
+{
+    int ret;
+
+    if (IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES))
+    {
+        ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &mbox_canaan_kfunc_set);
+        if (ret)
+            pr_warn("mailbox_client: rx verdict kfunc not registered: %d\n", ret);
+    }
 
-// static int __init mbox_canaan_client_init(void)
-// {
-//     int ret;
-//     ret = platform_driver_register(&mbox_canaan_client_driver);
-//     return 0;
-// }
+    return platform_driver_register(&mbox_canaan_client_driver);
+}
 
-// static void __exit mbox_canaan_client_exit(void)
-// {
-//     platform_driver_unregister(&mbox_canaan_client_driver);
-// }
+static void __exit mbox_canaan_client_exit(void)
+{
+    platform_driver_unregister(&mbox_canaan_client_driver);
+}
 
-// module_init(mbox_canaan_client_init);
-// module_exit(mbox_canaan_client_exit);
+module_init(mbox_canaan_client_init);
+module_exit(mbox_canaan_client_exit);
 
+#ifdef MODULE_IMPORT_NS
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
 MODULE_DESCRIPTION("Canaan mailbox client driver");
 MODULE_AUTHOR("lst");
 MODULE_LICENSE("GPL v2");
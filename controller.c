@@ -8,9 +8,17 @@
 #include <linux/mailbox_controller.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/of.h>
 #include <linux/slab.h>
 #include <linux/clk.h>
 #include <linux/pm_wakeirq.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
 
 #define CPU2DSP_INT_EN          0x00
 #define CPU2DSP_INT_SET         0x04
@@ -49,15 +57,45 @@
 #define DSP_REPLY_INT_MASK          (0xFFFF0000)
 
 #define SINGLE_DIR_CHAN_NUM     8
+#define MAILBOX_CHAN_NUM        (SINGLE_DIR_CHAN_NUM * 2)
+
+/*
+ * Channel n is rung (tx) or acked (rx) by the CPU on CPU2DSP slot n, the
+ * DSP acks (tx) or rings (rx) it on DSP2CPU slot n ^ SINGLE_DIR_CHAN_NUM.
+ * Which channels are rx is set by the DT property "canaan,rx-channels",
+ * a bit mask of channel numbers, by default the upper eight.
+ */
+#define MAILBOX_DEFAULT_RX_MASK 0xff00
+
+/*
+ * Bypass mode: one privileged process owns the mailbox through
+ * /dev/canaan-mailbox, UIO style. mmap offset 0 is the register block,
+ * offset PAGE_SIZE the optional second reg entry with the channel windows.
+ * read() blocks and returns the s32 interrupt count, write() of a s32
+ * 1/0 unmasks/masks the dsp2cpu interrupt, which the handler masks on
+ * every interrupt. The interrupt can also be signalled on an eventfd.
+ */
+#define MAILBOX_BYPASS_NAME         "canaan-mailbox"
+#define MAILBOX_BYPASS_SET_EVENTFD  _IOW('M', 0, int)
 
 struct canaan_mailbox {
     struct device *dev;
     void __iomem *base;
-    struct mbox_chan chan[SINGLE_DIR_CHAN_NUM*2];
+    struct mbox_chan chan[MAILBOX_CHAN_NUM];
+    u32 rx_mask;
     struct mbox_controller controller;
     struct clk *clk;
     int irq;
     spinlock_t lock;
+    struct resource *res;
+    struct resource *win_res;
+    struct miscdevice bypass_dev;
+    atomic_t bypass;
+    wait_queue_head_t bypass_waitq;
+    struct eventfd_ctx *bypass_eventfd;
+    s32 bypass_count;
+    s32 bypass_seen;
+    bool removing;
 };
 
 static struct canaan_mailbox *to_canaan_mailbox(struct mbox_controller *mbox)
@@ -75,6 +113,17 @@ static void mailbox_dsp2cpu_int_enable(struct canaan_mailbox *mbox)
     writel(MAILBOX_RAW_EN | MAILBOX_INT_EN, mbox->base + DSP2CPU_INT_EN);
 }
 
+static void mailbox_dsp2cpu_int_disable(struct canaan_mailbox *mbox)
+{
+    /* write enable bits set, enable bit cleared */
+    writel(MAILBOX_RAW_EN, mbox->base + DSP2CPU_INT_EN);
+}
+
+static bool mailbox_chan_is_rx(struct canaan_mailbox *mbox, unsigned int chan_number)
+{
+    return mbox->rx_mask & BIT(chan_number);
+}
+
 static u32 get_chan_number(u32 reg_value)
 {
     int i;
@@ -88,8 +137,21 @@ static u32 get_chan_number(u32 reg_value)
 static irqreturn_t canaan_mailbox_irq(int irq, void *data)
 {
     struct canaan_mailbox *mbox = data;
-    unsigned int chan_number;
+    unsigned int chan_number, chan;
     u32 reg_value;
+
+    if (atomic_read(&mbox->bypass))
+    {
+        /* userspace demuxes and clears, it unmasks again through write() */
+        mailbox_dsp2cpu_int_disable(mbox);
+        spin_lock(&mbox->lock);
+        mbox->bypass_count++;
+        if (mbox->bypass_eventfd)
+            eventfd_signal(mbox->bypass_eventfd, 1);
+        spin_unlock(&mbox->lock);
+        wake_up_interruptible(&mbox->bypass_waitq);
+        return IRQ_HANDLED;
+    }
     
     reg_value = readl(mbox->base + DSP2CPU_INT_STATUS);
     chan_number = get_chan_number(reg_value);
@@ -98,25 +160,26 @@ static irqreturn_t canaan_mailbox_irq(int irq, void *data)
     writel(chan_number, mbox->base + DSP2CPU_INT_CLEAR);
     // printk("[%s,%d], reg_value: %x, chan_number: %d", __func__, __LINE__, reg_value, chan_number);
 
-    if (chan_number >= SINGLE_DIR_CHAN_NUM)
+    chan = chan_number ^ SINGLE_DIR_CHAN_NUM;
+    if (!mailbox_chan_is_rx(mbox, chan))
     {
-        if (!mbox->chan[chan_number - SINGLE_DIR_CHAN_NUM].cl)
+        if (!mbox->chan[chan].cl)
         {
             dev_err(mbox->dev, "illegal tx channel\n");
             return -ENODEV;
         }
         // printk("[%s,%d], chan_number: %d", __func__, __LINE__, chan_number);
-        mbox_chan_txdone(&mbox->chan[chan_number - SINGLE_DIR_CHAN_NUM], 0);
+        mbox_chan_txdone(&mbox->chan[chan], 0);
     }
     else
     {
-        if (!mbox->chan[chan_number + SINGLE_DIR_CHAN_NUM].cl)
+        if (!mbox->chan[chan].cl)
         {
             dev_err(mbox->dev, "illegal rx channel\n");
             return IRQ_HANDLED;
         }
-        mbox_chan_received_data(&mbox->chan[chan_number + SINGLE_DIR_CHAN_NUM], NULL);
-        writel(chan_number + SINGLE_DIR_CHAN_NUM, mbox->base + CPU2DSP_INT_SET);
+        mbox_chan_received_data(&mbox->chan[chan], NULL);
+        writel(chan, mbox->base + CPU2DSP_INT_SET);
     }
 
     return IRQ_HANDLED;
@@ -127,9 +190,12 @@ static int canaan_mailbox_send_data(struct mbox_chan *chan, void *data)
     unsigned int chan_number = (unsigned int)chan->con_priv;
     struct canaan_mailbox *mbox = to_canaan_mailbox(chan->mbox);
 
-    if (chan_number > SINGLE_DIR_CHAN_NUM)
+    if (atomic_read(&mbox->bypass))
+        return -EBUSY;
+
+    if (mailbox_chan_is_rx(mbox, chan_number))
     {
-        dev_err(mbox->dev, "tx channel: 0-8, current channel number: %d\n", chan_number);
+        dev_err(mbox->dev, "channel %d is an rx channel\n", chan_number);
         return -ENODEV;
     }
     /* Notify that the transmission is complete */
@@ -141,6 +207,15 @@ static int canaan_mailbox_send_data(struct mbox_chan *chan, void *data)
 
 static int canaan_mailbox_startup(struct mbox_chan *chan)
 {
+    struct canaan_mailbox *mbox = to_canaan_mailbox(chan->mbox);
+
+    /* chan->cl is already set, pairs with the check in bypass open */
+    smp_mb();
+    if (atomic_read(&mbox->bypass))
+    {
+        dev_err(mbox->dev, "mailbox is owned by userspace\n");
+        return -EBUSY;
+    }
 
     return 0;
 }
@@ -156,15 +231,228 @@ static struct mbox_chan *canaan_mailbox_xlate(struct mbox_controller *controller
     struct canaan_mailbox *mbox = to_canaan_mailbox(controller);
     unsigned int ch = spec->args[0];
 
-    if (ch >= SINGLE_DIR_CHAN_NUM * 2)
+    if (ch >= MAILBOX_CHAN_NUM)
     {
         dev_err(mbox->dev, "Invalid channel index %d\n", ch);
         return ERR_PTR(-EINVAL);
     }
 
+    /* an optional second cell states the direction the client expects, 1 is rx */
+    if (spec->args_count > 1 && !!spec->args[1] != mailbox_chan_is_rx(mbox, ch))
+    {
+        dev_err(mbox->dev, "channel %d is not an %s channel\n", ch,
+                spec->args[1] ? "rx" : "tx");
+        return ERR_PTR(-EINVAL);
+    }
+
     return &mbox->chan[ch];
 }
 
+/* bypass */
+
+static struct canaan_mailbox *to_bypass_mailbox(struct file *filp)
+{
+    struct miscdevice *misc = filp->private_data;
+
+    return container_of(misc, struct canaan_mailbox, bypass_dev);
+}
+
+static int canaan_mailbox_bypass_open(struct inode *inode, struct file *filp)
+{
+    struct canaan_mailbox *mbox = to_bypass_mailbox(filp);
+    unsigned long flags;
+    unsigned int i;
+
+    if (!capable(CAP_SYS_RAWIO))
+        return -EPERM;
+
+    if (READ_ONCE(mbox->removing))
+        return -ENODEV;
+
+    if (atomic_cmpxchg(&mbox->bypass, 0, 1))
+        return -EBUSY;
+
+    /* every kernel client has to release its channels first */
+    for (i = 0; i < mbox->controller.num_chans; i++)
+    {
+        if (READ_ONCE(mbox->chan[i].cl))
+        {
+            atomic_set(&mbox->bypass, 0);
+            wake_up(&mbox->bypass_waitq);
+            dev_err(mbox->dev, "channel %d is used by a kernel client\n", i);
+            return -EBUSY;
+        }
+    }
+
+    spin_lock_irqsave(&mbox->lock, flags);
+    mbox->bypass_seen = mbox->bypass_count;
+    spin_unlock_irqrestore(&mbox->lock, flags);
+
+    return 0;
+}
+
+static int canaan_mailbox_bypass_release(struct inode *inode, struct file *filp)
+{
+    struct canaan_mailbox *mbox = to_bypass_mailbox(filp);
+    struct eventfd_ctx *ctx;
+    unsigned long flags;
+
+    spin_lock_irqsave(&mbox->lock, flags);
+    ctx = mbox->bypass_eventfd;
+    mbox->bypass_eventfd = NULL;
+    spin_unlock_irqrestore(&mbox->lock, flags);
+    if (ctx)
+        eventfd_ctx_put(ctx);
+
+    mailbox_dsp2cpu_int_enable(mbox);
+    /* a mapping holds the file, so this is also the last munmap */
+    atomic_set(&mbox->bypass, 0);
+    wake_up(&mbox->bypass_waitq);
+
+    return 0;
+}
+
+static ssize_t canaan_mailbox_bypass_read(struct file *filp, char __user *buf,
+                                        size_t count, loff_t *ppos)
+{
+    struct canaan_mailbox *mbox = to_bypass_mailbox(filp);
+    unsigned long flags;
+    s32 event;
+    int ret;
+
+    if (count != sizeof(s32))
+        return -EINVAL;
+
+    if (filp->f_flags & O_NONBLOCK && READ_ONCE(mbox->bypass_count) == mbox->bypass_seen)
+        return -EAGAIN;
+
+    ret = wait_event_interruptible(mbox->bypass_waitq,
+                                READ_ONCE(mbox->bypass_count) != mbox->bypass_seen ||
+                                READ_ONCE(mbox->removing));
+    if (ret)
+        return ret;
+
+    if (READ_ONCE(mbox->removing))
+        return -ENODEV;
+
+    spin_lock_irqsave(&mbox->lock, flags);
+    event = mbox->bypass_count;
+    mbox->bypass_seen = event;
+    spin_unlock_irqrestore(&mbox->lock, flags);
+
+    if (copy_to_user(buf, &event, sizeof(event)))
+        return -EFAULT;
+
+    return sizeof(event);
+}
+
+static ssize_t canaan_mailbox_bypass_write(struct file *filp, const char __user *buf,
+                                        size_t count, loff_t *ppos)
+{
+    struct canaan_mailbox *mbox = to_bypass_mailbox(filp);
+    s32 irq_on;
+
+    if (count != sizeof(s32))
+        return -EINVAL;
+
+    if (copy_from_user(&irq_on, buf, sizeof(irq_on)))
+        return -EFAULT;
+
+    if (irq_on)
+        mailbox_dsp2cpu_int_enable(mbox);
+    else
+        mailbox_dsp2cpu_int_disable(mbox);
+
+    return sizeof(irq_on);
+}
+
+static __poll_t canaan_mailbox_bypass_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct canaan_mailbox *mbox = to_bypass_mailbox(filp);
+
+    poll_wait(filp, &mbox->bypass_waitq, wait);
+
+    if (READ_ONCE(mbox->removing))
+        return EPOLLHUP | EPOLLERR;
+
+    if (READ_ONCE(mbox->bypass_count) != mbox->bypass_seen)
+        return EPOLLIN | EPOLLRDNORM;
+
+    return 0;
+}
+
+static long canaan_mailbox_bypass_ioctl(struct file *filp, unsigned int cmd,
+                                        unsigned long arg)
+{
+    struct canaan_mailbox *mbox = to_bypass_mailbox(filp);
+    struct eventfd_ctx *ctx = NULL, *old;
+    unsigned long flags;
+    int fd;
+
+    if (cmd != MAILBOX_BYPASS_SET_EVENTFD)
+        return -EINVAL;
+
+    if (get_user(fd, (int __user *)arg))
+        return -EFAULT;
+
+    /* a negative fd removes the eventfd */
+    if (fd >= 0)
+    {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_irqsave(&mbox->lock, flags);
+    old = mbox->bypass_eventfd;
+    mbox->bypass_eventfd = ctx;
+    spin_unlock_irqrestore(&mbox->lock, flags);
+    if (old)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+static int canaan_mailbox_bypass_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct canaan_mailbox *mbox = to_bypass_mailbox(filp);
+    unsigned long len = vma->vm_end - vma->vm_start;
+    struct resource *res;
+
+    if (READ_ONCE(mbox->removing))
+        return -ENODEV;
+
+    if (vma->vm_pgoff == 0)
+        res = mbox->res;
+    else if (vma->vm_pgoff == 1)
+        res = mbox->win_res;
+    else
+        return -EINVAL;
+
+    if (!res || (res->start & ~PAGE_MASK))
+        return -EINVAL;
+
+    if (len > PAGE_ALIGN(resource_size(res)))
+        return -EINVAL;
+
+    vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+    return io_remap_pfn_range(vma, vma->vm_start, res->start >> PAGE_SHIFT,
+                            len, vma->vm_page_prot);
+}
+
+static const struct file_operations canaan_mailbox_bypass_fops = {
+    .owner          = THIS_MODULE,
+    .open           = canaan_mailbox_bypass_open,
+    .release        = canaan_mailbox_bypass_release,
+    .read           = canaan_mailbox_bypass_read,
+    .write          = canaan_mailbox_bypass_write,
+    .poll           = canaan_mailbox_bypass_poll,
+    .unlocked_ioctl = canaan_mailbox_bypass_ioctl,
+    .mmap           = canaan_mailbox_bypass_mmap,
+};
+
 static const struct mbox_chan_ops canaan_mailbox_ops = {
     .send_data  = canaan_mailbox_send_data,
     .startup    = canaan_mailbox_startup,
@@ -191,6 +479,8 @@ static int canaan_mailbox_probe(struct platform_device *pdev)
         return -ENOMEM;
 
     spin_lock_init(&priv->lock);
+    init_waitqueue_head(&priv->bypass_waitq);
+    atomic_set(&priv->bypass, 0);
 
     priv->dev = dev;
 
@@ -198,6 +488,14 @@ static int canaan_mailbox_probe(struct platform_device *pdev)
     priv->base = devm_ioremap_resource(dev, res);
     if (IS_ERR(priv->base))
         return PTR_ERR(priv->base);
+    priv->res = res;
+
+    /* channel windows, only used by bypass mode */
+    priv->win_res = platform_get_resource(pdev, IORESOURCE_MEM, 1);
+
+    priv->rx_mask = MAILBOX_DEFAULT_RX_MASK;
+    of_property_read_u32(np, "canaan,rx-channels", &priv->rx_mask);
+    priv->rx_mask &= GENMASK(MAILBOX_CHAN_NUM - 1, 0);
 
     priv->clk = devm_clk_get(dev, NULL);
     if (IS_ERR(priv->clk))
@@ -228,7 +526,7 @@ static int canaan_mailbox_probe(struct platform_device *pdev)
     priv->controller.dev = dev;
     priv->controller.ops = &canaan_mailbox_ops;
     priv->controller.chans = priv->chan;
-    priv->controller.num_chans = SINGLE_DIR_CHAN_NUM * 2;
+    priv->controller.num_chans = MAILBOX_CHAN_NUM;
     priv->controller.txdone_irq = true;
     priv->controller.of_xlate = canaan_mailbox_xlate;
 
@@ -247,6 +545,17 @@ static int canaan_mailbox_probe(struct platform_device *pdev)
     mailbox_cpu2dsp_int_enable(priv);
     mailbox_dsp2cpu_int_enable(priv);
 
+    priv->bypass_dev.minor = MISC_DYNAMIC_MINOR;
+    priv->bypass_dev.name = MAILBOX_BYPASS_NAME;
+    priv->bypass_dev.fops = &canaan_mailbox_bypass_fops;
+    priv->bypass_dev.parent = dev;
+    ret = misc_register(&priv->bypass_dev);
+    if (ret)
+    {
+        dev_warn(dev, "Failed to register bypass device %d\n", ret);
+        priv->bypass_dev.this_device = NULL;
+    }
+
 
     platform_set_drvdata(pdev, priv);
     dev_info(dev, "Mailbox enabled\n");
@@ -263,6 +572,20 @@ static int canaan_mailbox_remove(struct platform_device *pdev)
 {
     struct canaan_mailbox *priv = platform_get_drvdata(pdev);
 
+    if (priv->bypass_dev.this_device)
+        misc_deregister(&priv->bypass_dev);
+
+    /*
+     * priv and the registers go away with us, so an open or mapped bypass
+     * file has to be closed first. Readers and pollers get -ENODEV/EPOLLHUP
+     * to tell them.
+     */
+    WRITE_ONCE(priv->removing, true);
+    wake_up(&priv->bypass_waitq);
+    if (atomic_read(&priv->bypass))
+        dev_info(&pdev->dev, "waiting for the bypass device to be closed\n");
+    wait_event(priv->bypass_waitq, !atomic_read(&priv->bypass));
+
     mbox_controller_unregister(&priv->controller);
     clk_disable_unprepare(priv->clk);
     dev_info(&pdev->dev, "Mailbox disabled\n");
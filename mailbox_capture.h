@@ -0,0 +1,23 @@
+#ifndef __MAILBOX_CAPTURE_H__
+#define __MAILBOX_CAPTURE_H__
+
+#include <linux/types.h>
+
+/* shared by client.c and replay.c, the layout of the debugfs capture0 file */
+
+#define MBOX_MAX_MSG_LEN        32
+
+#define MBOX_DIR_TX             0
+#define MBOX_DIR_RX             1
+
+/* one capture record, sub-buffers hold a whole number of them so no padding */
+struct mbox_canaan_capture_record {
+    __u64   timestamp;          /* ktime_get_ns() */
+    __u32   seq;
+    __u8    chan;
+    __u8    dir;
+    __u16   reserved;
+    __u8    payload[MBOX_MAX_MSG_LEN];
+} __attribute__((packed));
+
+#endif
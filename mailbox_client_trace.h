@@ -0,0 +1,64 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mailbox_client
+
+#if !defined(_MAILBOX_CLIENT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MAILBOX_CLIENT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "mailbox_capture.h"
+
+#ifndef _MAILBOX_CLIENT_RX_CTX
+#define _MAILBOX_CLIENT_RX_CTX
+
+enum mbox_canaan_rx_action {
+    MBOX_RX_ACTION_PASS,
+    MBOX_RX_ACTION_DROP,
+    MBOX_RX_ACTION_REDIRECT,
+};
+
+/*
+ * Argument of the mbox_canaan_rx_filter tracepoint. It starts out with the
+ * default verdict of the channel, a tp_btf program attached to the
+ * tracepoint reads payload and replaces the verdict with the
+ * bpf_mbox_canaan_rx_verdict() kfunc, target is the rx channel index of a
+ * redirect.
+ */
+struct mbox_canaan_rx_ctx {
+    int                         chan;
+    const u8                    *payload;
+    enum mbox_canaan_rx_action  action;
+    u32                         target;
+    bool                        from_bpf;
+};
+
+#endif
+
+TRACE_EVENT(mbox_canaan_rx_filter,
+
+    TP_PROTO(struct mbox_canaan_rx_ctx *ctx),
+
+    TP_ARGS(ctx),
+
+    TP_STRUCT__entry(
+        __field(int, chan)
+        __array(u8, payload, MBOX_MAX_MSG_LEN)
+    ),
+
+    TP_fast_assign(
+        __entry->chan = ctx->chan;
+        memcpy(__entry->payload, ctx->payload, MBOX_MAX_MSG_LEN);
+    ),
+
+    TP_printk("chan=%d payload=%s", __entry->chan,
+        __print_hex(__entry->payload, MBOX_MAX_MSG_LEN))
+);
+
+#endif
+
+/* client.o is built with -I$(src) so define_trace.h finds this file */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mailbox_client_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "mailbox_capture.h"
+
+/*
+ * Replay a capture taken from /sys/kernel/debug/mailbox-client/capture0:
+ *
+ *   echo 1 > /sys/kernel/debug/mailbox-client/capture_enable
+ *   cat /sys/kernel/debug/mailbox-client/capture0 > trace.bin
+ *   ./replay [-s scale] [-e service_us] trace.bin
+ *
+ * Tx records are reissued on their channel at the captured timing, stretched
+ * by 'scale' (0 sends back to back). With -e no device is opened and the
+ * controller is emulated instead: each channel holds one message at a time
+ * for service_us, a send arriving while its channel is busy waits for it,
+ * and the replay runs in virtual time so queueing shows up without sleeping.
+ */
+
+#define MBOX_CHAN_TX(n)         _IOW('m', (n), unsigned long)
+#define MBOX_CHAN_NUM           16
+
+#define MBOX_DEV                "/dev/mailbox-client"
+
+struct chan_stats {
+    uint64_t    busy_until;     /* emulated channel occupied until, virtual ns */
+    uint64_t    sent;
+    uint64_t    queued;         /* sends that found the channel busy */
+    uint64_t    wait_sum;
+    uint64_t    wait_max;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000000ull;
+    ts.tv_nsec = deadline % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void usage(const char *name)
+{
+    printf("usage: %s [-s scale] [-e service_us] capture.bin\r\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct chan_stats chans[MBOX_CHAN_NUM];
+    const struct mbox_canaan_capture_record *rec;
+    struct chan_stats *cs;
+    struct stat st;
+    double scale = 1.0;
+    long service_us = -1;
+    size_t count, i;
+    uint64_t t0, base, delta, deadline, start, lat, wait;
+    uint64_t lat_sum = 0, lat_max = 0, lag, lag_max = 0;
+    unsigned long sent = 0, rx = 0, errors = 0;
+    int opt, fd, dev = -1;
+
+    while ((opt = getopt(argc, argv, "s:e:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's' :
+                scale = atof(optarg);
+                break;
+            case 'e' :
+                service_us = atol(optarg);
+                break;
+            default :
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind >= argc || scale < 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) < 0)
+    {
+        printf("open failed %s\r\n", argv[optind]);
+        return -1;
+    }
+    count = st.st_size / sizeof(*rec);
+    if (count == 0)
+    {
+        printf("empty capture\r\n");
+        close(fd);
+        return 0;
+    }
+
+    rec = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (rec == MAP_FAILED)
+    {
+        printf("mmap failed %s\r\n", argv[optind]);
+        close(fd);
+        return -1;
+    }
+
+    if (service_us < 0)
+    {
+        dev = open(MBOX_DEV, O_RDWR);
+        if (dev == -1)
+        {
+            printf("open failed %s\r\n", MBOX_DEV);
+            munmap((void *)rec, st.st_size);
+            close(fd);
+            return -1;
+        }
+    }
+
+    t0 = rec[0].timestamp;
+    base = dev == -1 ? 0 : now_ns();
+    for (i = 0; i < count; i++)
+    {
+        if (rec[i].dir != MBOX_DIR_TX || rec[i].chan >= MBOX_CHAN_NUM)
+        {
+            rx++;
+            continue;
+        }
+        cs = &chans[rec[i].chan];
+
+        /* captures taken by older drivers may go backwards, clamp to t0 */
+        delta = rec[i].timestamp > t0 ? rec[i].timestamp - t0 : 0;
+        deadline = base + (uint64_t)(delta * scale);
+
+        if (dev == -1)
+        {
+            /* emulated: the send is served once the channel is free */
+            wait = cs->busy_until > deadline ? cs->busy_until - deadline : 0;
+            cs->busy_until = deadline + wait + service_us * 1000ull;
+            lag = wait;
+            lat = wait + service_us * 1000ull;
+        }
+        else
+        {
+            sleep_until_ns(deadline);
+            start = now_ns();
+            lag = start - deadline;
+            wait = 0;
+            if (ioctl(dev, MBOX_CHAN_TX(rec[i].chan), rec[i].payload) < 0)
+                errors++;
+            lat = now_ns() - start;
+        }
+
+        if (lag > lag_max)
+            lag_max = lag;
+        lat_sum += lat;
+        if (lat > lat_max)
+            lat_max = lat;
+        if (wait)
+            cs->queued++;
+        cs->wait_sum += wait;
+        if (wait > cs->wait_max)
+            cs->wait_max = wait;
+        cs->sent++;
+        sent++;
+    }
+
+    printf("records: %zu, tx replayed: %lu, rx skipped: %lu, errors: %lu\r\n",
+        count, sent, rx, errors);
+    if (sent)
+        printf("send latency avg: %llu ns, max: %llu ns, max lag behind schedule: %llu ns\r\n",
+            (unsigned long long)(lat_sum / sent), (unsigned long long)lat_max,
+            (unsigned long long)lag_max);
+
+    if (dev == -1)
+    {
+        printf("chan  sent  queued  wait avg ns  wait max ns\r\n");
+        for (i = 0; i < MBOX_CHAN_NUM; i++)
+        {
+            cs = &chans[i];
+            if (!cs->sent)
+                continue;
+            printf("%4zu  %4llu  %6llu  %11llu  %11llu\r\n", i,
+                (unsigned long long)cs->sent, (unsigned long long)cs->queued,
+                (unsigned long long)(cs->wait_sum / cs->sent),
+                (unsigned long long)cs->wait_max);
+        }
+    }
+
+    if (dev != -1)
+        close(dev);
+    munmap((void *)rec, st.st_size);
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Read a "latest value" rx channel without syscalls or interrupts:
+ *
+ *   ./snapshot <rx chan>
+ *
+ * The DSP keeps seq odd while it updates the window, a reader retries
+ * until it copied the data between two equal, even reads of seq.
+ * Switching the channel to snapshot mode needs CAP_SYS_ADMIN, mapping a
+ * window that does not own its pages needs CAP_SYS_RAWIO.
+ */
+
+#define MBOX_MAX_MSG_LEN        32
+
+#define MBOX_DEV                "/dev/mailbox-client"
+
+/* must match client.c */
+struct mbox_canaan_snapshot_config {
+    uint32_t    chan;
+    uint32_t    enable;
+    uint32_t    offset;
+    uint32_t    size;
+};
+
+struct mbox_canaan_snapshot {
+    uint32_t    seq;
+    uint32_t    len;
+    uint8_t     data[];
+};
+
+#define MBOX_SNAPSHOT_CONFIG    _IOWR('m', 0x13, struct mbox_canaan_snapshot_config)
+
+static uint32_t snapshot_read(volatile struct mbox_canaan_snapshot *snap,
+                            uint8_t *buf, uint32_t *lenp)
+{
+    uint32_t max = *lenp;
+    uint32_t seq, len, i;
+
+    do
+    {
+        while ((seq = snap->seq) & 1);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        len = snap->len;
+        if (len > max)
+            len = max;
+        for (i = 0; i < len; i++)
+            buf[i] = snap->data[i];
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (snap->seq != seq);
+
+    *lenp = len;
+    return seq;
+}
+
+int main(int argc, char *argv[])
+{
+    struct mbox_canaan_snapshot_config config;
+    volatile struct mbox_canaan_snapshot *snap;
+    uint8_t buf[MBOX_MAX_MSG_LEN];
+    uint32_t seq, last = 1, max, n, i;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t len;
+    void *map;
+    int fd;
+
+    if (argc < 2)
+    {
+        printf("usage: %s <rx chan>\r\n", argv[0]);
+        return -1;
+    }
+
+    fd = open(MBOX_DEV, O_RDWR);
+    if (fd == -1)
+    {
+        printf("open failed %s\r\n", MBOX_DEV);
+        return -1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.chan = atoi(argv[1]);
+    config.enable = 1;
+    if (ioctl(fd, MBOX_SNAPSHOT_CONFIG, &config) < 0)
+    {
+        printf("snapshot config error\r\n");
+        close(fd);
+        return -1;
+    }
+
+    len = (config.offset + config.size + page - 1) & ~(page - 1);
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, (off_t)config.chan * page);
+    if (map == MAP_FAILED)
+    {
+        printf("mmap failed\r\n");
+        close(fd);
+        return -1;
+    }
+    snap = (volatile struct mbox_canaan_snapshot *)((char *)map + config.offset);
+    max = config.size - sizeof(struct mbox_canaan_snapshot);
+    if (max > sizeof(buf))
+        max = sizeof(buf);
+
+    while (1)
+    {
+        n = max;
+        seq = snapshot_read(snap, buf, &n);
+        if (seq == last)
+            continue;
+        last = seq;
+
+        printf("\r\nseq %u:", seq);
+        for (i = 0; i < n; i++)
+            printf("%3x", buf[i]);
+    }
+
+    munmap(map, len);
+    close(fd);
+
+    return 0;
+}